@@ -7,24 +7,59 @@
 #include <ctime>
 #include <algorithm>
 #include <unordered_set>
+#include <unordered_map>
+#include <iterator>
 #include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <functional>
+#include <array>
+#include <new>
+#include <random>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <chrono>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 
 using namespace std;
 
 // structure to represent disease.
-//stores the value from the vector diseases made in main function.
+//stores one entry of the text catalogue (diseases.txt) while it is converted to the binary knowledge base.
 struct Disease
 {
     string name;
     vector<string> symptoms;
     vector<string> treatments;
+    vector<double> weights; // weight of each symptom, in the same order; left empty every symptom weighs 1
 };
 
 // Patient structure
 struct Patient
 {
     string patientId;
-    string password;
+    string password; // scrypt hash, or the plaintext password of a record not migrated yet
     string firstName;
     string lastName;
     string dob;
@@ -34,6 +69,374 @@ struct Patient
     string mobileNumber;
 };
 
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Maps the file, returns false if it cannot be opened; an empty file maps to an empty range
+    bool open(const string& path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        length = st.st_size;
+        if (length > 0)
+        {
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED)
+            {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+            bytes = static_cast<const char*>(mapped);
+        }
+        ::close(fd);
+        return true;
+    }
+
+    void close()
+    {
+        if (bytes != nullptr)
+            munmap(const_cast<char*>(bytes), length);
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+};
+
+// Append-only write-ahead log of registrations (patients.wal).
+// Every record is one line "<crc32 as 8 hex digits>\t<patient fields as in patients.txt>\n" written with
+// a single append, so a crash can at worst leave a torn last record, which the checksum exposes and
+// recovery drops. fsync is batched: the log is synced once LOG_SYNC_BATCH records are pending or
+// LOG_SYNC_INTERVAL_MS has passed since the last sync, and always when the log is closed.
+// For a compaction in the background the log is retired (renamed to patients.wal.old) and a new one
+// started, so registrations keep being logged while the snapshot is written.
+class PatientLog
+{
+public:
+    PatientLog() = default;
+    ~PatientLog() { close(); }
+    PatientLog(const PatientLog&) = delete;
+    PatientLog& operator=(const PatientLog&) = delete;
+
+    // Replays the valid records into replayed, cuts off a torn tail and opens the log for appending
+    bool open(const string& logPath, vector<Patient>& replayed);
+    bool append(const Patient& p);
+    void sync();
+    // Empties the log once its records are safely in the snapshot
+    bool truncate();
+    // Renames the log to retiredPath and carries on in a new, empty one
+    bool retire(const string& retiredPath);
+    void close();
+
+    bool isOpen() const { return fd >= 0; }
+    size_t records() const { return recordCount; }
+
+private:
+    int fd = -1;
+    string path;
+    off_t length = 0; // bytes of whole records
+    size_t recordCount = 0;
+    size_t pending = 0; // appended but not yet synced
+    chrono::steady_clock::time_point lastSync;
+};
+
+// Conditions of a patient query; every condition is inclusive and a default one matches everybody
+struct PatientQuery
+{
+    int minAge = 0;
+    int maxAge = INT32_MAX;
+    int32_t firstRegistrationDay = INT32_MIN; // day numbers, see daysFromCivil()
+    int32_t lastRegistrationDay = INT32_MAX;
+    char gender = 0;                          // 0 for any
+};
+
+// Compact, column-wise storage of patient rows.
+// Fields are packed instead of kept as strings: the ID "PID<n>" as the number n and its digit count,
+// both dates as day numbers, the mobile number as an integer, the gender as a bit. Password and names
+// live in one shared arena as NUL-terminated strings, so a row costs a few dozen bytes in a handful of
+// flat arrays and scans over a column touch only that column. A field that would not come back
+// exactly as it was written (an ID of another form, a date not in the usual format, ...) is kept as
+// text in the arena instead and flagged; patient() unpacks a row back into the Patient it was.
+class PatientTable
+{
+public:
+    size_t size() const { return idNumbers.size(); }
+    void reserve(size_t rows);
+    void push_back(const Patient& p);
+    // Moves the rows of other to the end of this table
+    void append(PatientTable&& other);
+
+    Patient patient(size_t row) const;
+    string patientId(size_t row) const;
+    // The n of "PID<n>" and its number of digits, or false for an ID of another form
+    bool idNumber(size_t row, uint32_t& number, int& digits) const;
+    string_view password(size_t row) const { return text(row, 0); }
+    string_view firstName(size_t row) const { return text(row, 1); }
+    string_view lastName(size_t row) const { return text(row, 2); }
+    int age(size_t row) const;
+    char gender(size_t row) const;
+    // Day number of the registration date, or UNKNOWN_DAY if it is not a YYYY/MM/DD date
+    int32_t registrationDay(size_t row) const { return registrationDays[row]; }
+    // The mobile number as an integer, or false if it is not 10 digits
+    bool mobile(size_t row, uint64_t& number) const;
+    string mobileNumber(size_t row) const;
+
+    // Bytes allocated for the rows
+    size_t memoryBytes() const;
+
+private:
+    // fields kept as text, in this order after password and names
+    enum : uint8_t
+    {
+        TEXT_ID = 1,
+        TEXT_DOB = 2,
+        TEXT_REGISTRATION = 4,
+        TEXT_AGE = 8,
+        TEXT_GENDER = 16,
+        TEXT_MOBILE = 32
+    };
+    // password, first and last name, and the six fields that may be kept as text
+    static const size_t FIELD_COUNT = 9;
+    string_view text(size_t row, int index) const;
+    string_view textField(size_t row, uint8_t field) const { return text(row, 3 + __builtin_popcount(textFields[row] & (field - 1))); }
+
+    vector<uint32_t> idNumbers;
+    vector<uint8_t> idDigits;
+    vector<uint8_t> textFields; // TEXT_ flags
+    vector<uint8_t> ages;
+    vector<int32_t> dobDays;
+    vector<int32_t> registrationDays;
+    vector<uint64_t> mobiles;
+    vector<uint64_t> female;    // bitmap; a gender other than M or F is kept as text
+    vector<uint64_t> textStart; // row -> offset of its first string in the arena
+    vector<char> arena;
+};
+
+// Hash index from a 64-bit key to a row, open addressing with linear probing in two flat arrays
+class RowHashIndex
+{
+public:
+    // Keeps the first row inserted for a key
+    void insert(uint64_t key, uint32_t row);
+    // Row of key, or false
+    bool find(uint64_t key, uint32_t& row) const;
+    void clear();
+    void reserve(size_t count);
+    size_t memoryBytes() const { return keys.capacity() * sizeof(uint64_t) + rows.capacity() * sizeof(uint32_t); }
+
+private:
+    size_t slot(uint64_t key) const { return (key * 0x9E3779B97F4A7C15ull) >> (64 - bits); }
+    void grow(size_t slots);
+
+    vector<uint64_t> keys; // key + 1, 0 for an empty slot
+    vector<uint32_t> rows;
+    size_t count = 0;
+    int bits = 0;
+};
+
+// Patient store kept in memory for the whole run.
+// Rows are kept packed in a PatientTable. Indexes on patient ID and mobile number make login and
+// lookup constant time: IDs of the form PID<n> index a flat array by n, mobile numbers a RowHashIndex,
+// and the few values of any other form a hash map. The highest numeric ID is tracked as patients are
+// added so a new ID never needs a scan.
+// Secondary indexes answer range and conjunction queries without a scan: rows grouped by age, rows
+// sorted by registration day, and a bitmap of rows per gender. A query starts from the condition
+// that selects the fewest rows and checks the others row by row.
+class PatientRepository
+{
+public:
+    // Returned by the lookups when there is no such patient
+    static const size_t NO_PATIENT = SIZE_MAX;
+
+    PatientRepository() = default;
+    explicit PatientRepository(const vector<Patient>& loaded);
+    ~PatientRepository();
+    PatientRepository(const PatientRepository&) = delete;
+    PatientRepository& operator=(const PatientRepository&) = delete;
+
+    // Loads the snapshot, replays the registration log on top of it and keeps the log open for appends.
+    // A log grown past its compaction threshold is compacted right away
+    bool open(const string& snapshotPath, const string& logPath);
+
+    // Adds a patient and indexes it, the patient ID must not be taken yet; returns its row.
+    // With an open log the registration is appended to it, the snapshot is only rewritten by compact()
+    // and compactInBackground(). Returns NO_PATIENT, and adds nothing, if the log cannot be written
+    size_t add(const Patient& p);
+
+    // Forces pending log records to disk
+    void sync() { log.sync(); }
+    // Writes a fresh snapshot and empties the log
+    bool compact();
+    // Once the log has grown past its threshold, retires it and writes a fresh snapshot from a copy of the
+    // rows on a background thread; also reaps the previous compaction. The server calls it on its tick
+    void compactInBackground();
+
+    // Returns the row of the patient with this ID, or NO_PATIENT
+    size_t findById(const string& patientId) const;
+    // Login accepts either the patient ID or the mobile number
+    size_t findByLogin(const string& idOrMobile) const;
+    // The patient in a row
+    Patient patient(size_t row) const { return table.patient(row); }
+    const PatientTable& rows() const { return table; }
+
+    // Next free ID, with the pattern PID0000 XX
+    string nextPatientId() const;
+
+    // IDs of the patients matching every condition of the query, in registration order: by registration
+    // day, those registered the same day in the order they were added, patients without a readable
+    // registration date first (a query on dates leaves them out)
+    vector<string> query(const PatientQuery& q) const;
+
+    size_t size() const { return table.size(); }
+    // Bytes allocated for the rows and indexes, roughly for the hash maps
+    size_t memoryBytes() const;
+
+private:
+    void reindex();
+    void index(size_t row);
+    bool matches(size_t row, const PatientQuery& q) const;
+
+    bool compactionDue() const;
+    void finishCompaction();
+
+    PatientTable table;
+    string snapshotFile;
+    string retiredLogFile; // the log being compacted, or left over by a compaction that failed
+    PatientLog log;
+    thread compactor;
+    atomic<bool> compactionFinished{false};
+    bool compactionSucceeded = false;
+    vector<uint32_t> rowByIdNumber;              // n of PID<n> -> row, NO_ROW where there is none
+    unordered_map<string, uint32_t> otherIds;    // IDs of another form, or a number already taken with other digits
+    RowHashIndex byMobile;                       // 10-digit mobile number -> row of the first patient registered with it
+    unordered_map<string, uint32_t> otherMobiles;
+    int maxId = 0;
+
+    // secondary indexes for queries
+    vector<vector<uint32_t>> byAge;                  // age (capped at MAX_INDEXED_AGE) -> rows, ascending
+    vector<pair<int32_t, uint32_t>> byRegistration;  // (day number, row), sorted
+    map<char, vector<uint64_t>> byGender;            // gender -> bitmap of rows
+    bool reindexing = false;
+};
+
+// Stages of the session flow whose latency is measured, and events that are counted (see the metrics
+// section for how they are recorded and exported)
+enum class Stage
+{
+    ReadPatients,
+    Login,
+    IdentifyDiseases,
+    SuggestTests,
+    CalculateBill,
+    Payment,
+    WritePatients,
+    Count
+};
+
+enum class Counter
+{
+    Sessions,
+    Logins,
+    FailedLogins,
+    Registrations,
+    Diagnoses,
+    CacheHits,
+    CacheMisses,
+    Matches,
+    Payments,
+    Count
+};
+
+const size_t STAGE_COUNT = static_cast<size_t>(Stage::Count);
+const size_t COUNTER_COUNT = static_cast<size_t>(Counter::Count);
+
+// Latencies are kept in 2^HISTOGRAM_SUB_BITS buckets per power of two nanoseconds, so every bucket is
+// within about 6% of the values in it, from 1 ns to the whole 64-bit range
+const int HISTOGRAM_SUB_BITS = 4;
+const size_t HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS;
+
+// Bucket of a latency in nanoseconds
+inline size_t histogramBucket(uint64_t ns)
+{
+    if (ns < (uint64_t(1) << HISTOGRAM_SUB_BITS))
+        return static_cast<size_t>(ns);
+    int shift = 63 - __builtin_clzll(ns) - HISTOGRAM_SUB_BITS;
+    return (static_cast<size_t>(shift + 1) << HISTOGRAM_SUB_BITS) + static_cast<size_t>((ns >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1));
+}
+
+// Metrics of one thread. Only the owning thread writes them, with a relaxed load and store, so recording
+// takes no lock and no locked instruction; the exporter may read them at any time.
+struct ThreadMetrics
+{
+    atomic<uint64_t> latency[STAGE_COUNT][HISTOGRAM_BUCKETS];
+    atomic<uint64_t> latencyTotal[STAGE_COUNT]; // nanoseconds
+    atomic<uint64_t> counters[COUNTER_COUNT];
+
+    static void add(atomic<uint64_t>& value, uint64_t n) { value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed); }
+};
+
+// Metrics of the calling thread, set up on first use
+thread_local ThreadMetrics* metricsOfThread = nullptr;
+ThreadMetrics& registerThreadMetrics();
+
+inline ThreadMetrics& threadMetrics()
+{
+    ThreadMetrics* metrics = metricsOfThread;
+    return metrics ? *metrics : registerThreadMetrics();
+}
+
+inline void countEvent(Counter counter, uint64_t n = 1)
+{
+    ThreadMetrics::add(threadMetrics().counters[static_cast<size_t>(counter)], n);
+}
+
+inline void recordStageLatency(Stage stage, uint64_t ns)
+{
+    ThreadMetrics& metrics = threadMetrics();
+    ThreadMetrics::add(metrics.latency[static_cast<size_t>(stage)][histogramBucket(ns)], 1);
+    ThreadMetrics::add(metrics.latencyTotal[static_cast<size_t>(stage)], ns);
+}
+
+// Records one pass through a stage that began at start, for stages that do not fit in one scope
+inline void recordStageLatency(Stage stage, chrono::steady_clock::time_point start)
+{
+    recordStageLatency(stage, static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count()));
+}
+
+// Times the enclosing scope as one pass through a stage
+class StageTimer
+{
+public:
+    explicit StageTimer(Stage stage) : stage(stage), start(chrono::steady_clock::now()) {}
+    ~StageTimer() { recordStageLatency(stage, start); }
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    Stage stage;
+    chrono::steady_clock::time_point start;
+};
+
 // Function prototypes
 string toLowercase(const string& str); // function to remove CASE SENSTITIVITY
 
@@ -44,13 +447,14 @@ bool isValidDate(const string& date);
 bool isNumeric(const string& str);
 
 //in case Patient not found in the text file, so registration shall be done and hence ID shall be generated.
-string generatePatientId(const vector<Patient>& patients);
-void registerPatient(vector<Patient>& patients);
+string generatePatientId(const PatientRepository& patients);
 
-void writePatients(const vector<Patient>& patients);
-vector<Patient> readPatients();
-
-bool login(vector<Patient>& patients);
+string formatPatient(const Patient& p);
+bool writeFileDurably(const string& path, const function<void(ostream&)>& write);
+bool writePatients(const vector<Patient>& patients, const string& path = "patients.txt");
+template <typename Rows>
+void readPatientRows(const string& path, unsigned threads, Rows& rows);
+vector<Patient> readPatients(const string& path = "patients.txt", unsigned threads = 0);
 
 // Converts a string to lowercase
 string toLowercase(const string& str)
@@ -110,920 +514,7025 @@ bool isValidDate(const string& date)
     return true;
 }
 
-// Generates unique patient ID, with the pattern of PID0000 XX
-string generatePatientId(const vector<Patient>& patients)
+// Number of days from 1970-01-01 to the given date of the proleptic Gregorian calendar
+int32_t daysFromCivil(int year, int month, int day)
 {
-    if (patients.empty())
-    {
-        //the values of repeated 0 do not make a diff, the ID will work if PID01 is also entered.
-        return "PID000001";
-    }
+    year -= month <= 2;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
 
-    int maxId = 0;
-    for (const Patient& p : patients)
-    {
-        int id = stoi(p.patientId.substr(3));
-        if (id > maxId) {
-            maxId = id;
-        }
-    }
-    //addition of numeric value (the suffix) by 1 for unique ID for each patient.
-    return "PID" + to_string(maxId + 1);
+// Parses a 10-character date in place, its year, month and day at the given offsets; exact (if given) tells
+// whether the day number formats back to the same text, which a day past the end of its month does not
+bool parseDateAt(string_view date, size_t yearAt, size_t monthAt, size_t dayAt, int32_t& day, bool* exact = nullptr);
+
+// Parses a registration date, YYYY/MM/DD, into a day number
+bool parseRegistrationDay(string_view date, int32_t& day, bool* exact = nullptr)
+{
+    return date.size() == 10 && date[4] == '/' && date[7] == '/' && parseDateAt(date, 0, 5, 8, day, exact);
 }
 
-// Writes patients data to file when a new patient is registered.
-void writePatients(const vector<Patient>& patients)
+// Ages above this share the last age bucket
+const int MAX_INDEXED_AGE = 150;
+// Registration day of records whose date does not parse; they never match a date condition
+const int32_t UNKNOWN_DAY = INT32_MIN;
+
+// Date of a day number, the inverse of daysFromCivil()
+void civilFromDays(int32_t days, int& year, int& month, int& day)
 {
-    ofstream file("patients.txt");
-    if (file.is_open())
-    {
-        for (const Patient& p : patients)
-        {
-            file << p.patientId << "\t" << p.password << "\t" << p.firstName << "\t" << p.lastName << "\t" << p.dob << "\t" << p.age << "\t" << p.gender << "\t" << p.registrationDate << "\t" << p.mobileNumber <<endl;
-        }
-        file.close();
-    }
+    int z = days + 719468;
+    int era = (z >= 0 ? z : z - 146096) / 146097;
+    int dayOfEra = z - era * 146097;
+    int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int monthIndex = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    year = yearOfEra + era * 400 + (month <= 2);
 }
 
-// Reads patient data from file and adds it into a vector
-vector<Patient> readPatients()
+// Registration date of a day number, YYYY/MM/DD
+string formatRegistrationDay(int32_t days)
 {
-    vector<Patient> patients;
-    //text file reading
-    ifstream file("patients.txt");
-    if (file.is_open())
-    {
-        string line;
-        while (getline(file, line))
-        {
-            istringstream iss(line);
-            //data of patients is stored in a structure of the same name.
-            Patient p;
-            iss >> p.patientId >> p.password >> p.firstName >> p.lastName >> p.dob >> p.age >> p.gender >> p.registrationDate >> p.mobileNumber;
-            patients.push_back(p);
-        }
-        file.close();
-    }
-    return patients;
+    int year, month, day;
+    civilFromDays(days, year, month, day);
+    char text[16];
+    snprintf(text, sizeof(text), "%04d/%02d/%02d", year, month, day);
+    return text;
 }
 
-bool login(vector<Patient>& patients, string& user_ID)
+// Date of birth of a day number, DD/MM/YYYY
+string formatBirthDay(int32_t days)
 {
-    cout<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*"<<endl;
-    cout<<"* WELCOME TO DISEASE IDENTIFYING SYSTEM *" <<endl;
-    cout<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*"<<endl;
+    int year, month, day;
+    civilFromDays(days, year, month, day);
+    char text[16];
+    snprintf(text, sizeof(text), "%02d/%02d/%04d", day, month, year);
+    return text;
+}
 
-    string userId, password;
-    cout<<"Enter your user ID or mobile number: ";
-    getline(cin, userId);
+// Parses a date of birth, DD/MM/YYYY, into a day number
+bool parseBirthDay(string_view date, int32_t& day, bool* exact = nullptr)
+{
+    return date.size() == 10 && date[2] == '/' && date[5] == '/' && parseDateAt(date, 6, 3, 0, day, exact);
+}
 
-    auto it = find_if(patients.begin(), patients.end(), [&](const Patient& p) { return p.patientId == userId || p.mobileNumber == userId; });
-    if (it != patients.end())
-    {
-        int attempts = 3; // Number of attempts allowed
-        while (attempts > 0)
-        {
-            cout<<"Enter your password: ";
-            getline(cin, password);
-            if (password == it->password)
-            {
-                cout<<"\n*********************************************************************\n";
-                cout<<"* LOGIN SUCCESSFUL!! WELCOME, " << it->firstName << " " << it->lastName << " *" <<endl;
-                cout<<"***********************************************************************\n\n";
-                user_ID = it->patientId; // Update user_ID with the logged-in user's ID
-                return true;
-            }
-            else
-            {
-                attempts--;
-                if (attempts > 0)
-                {
-                    cout<<"***************************************************"<<endl;
-                    cout<<"* INCORRECT PASSWORD. " << attempts << " ATTEMPTS LEFT *" <<endl;
-                    cout<<"***************************************************"<<endl;
-                }
-                else
-                {
-                    cout<<"************************************************"<<endl;
-                    cout<<"*  INCORRECT PASSWORD. NO MORE ATTEMPTS LEFT.  *"<<endl;
-                    cout<<"************************************************"<<endl;
-                    break;
-                }
-            }
-        }
-    }
-    else
+bool parseDateAt(string_view date, size_t yearAt, size_t monthAt, size_t dayAt, int32_t& day, bool* exact)
+{
+    int year = 0, month = 0, dayOfMonth = 0;
+    const char* text = date.data();
+    if (from_chars(text + yearAt, text + yearAt + 4, year).ptr != text + yearAt + 4 ||
+        from_chars(text + monthAt, text + monthAt + 2, month).ptr != text + monthAt + 2 ||
+        from_chars(text + dayAt, text + dayAt + 2, dayOfMonth).ptr != text + dayAt + 2 ||
+        month < 1 || month > 12 || dayOfMonth < 1 || dayOfMonth > 31)
+        return false;
+    day = daysFromCivil(year, month, dayOfMonth);
+    if (exact)
     {
-        char choice;
-        cout<<"*****************"<<endl;
-        cout<<"* INVALID CREDENTIALS. NO PATIENT FOUND. **"<<endl;
-        cout<<"*****************"<<endl;
-        cout<<"\nDo you want to register? (Y/N): ";
-        cin >> choice;
-        if (toupper(choice) == 'Y')
-        {
-            cin.ignore(); // Ignore newline character from previous input
-            registerPatient(patients); // Call registerPatient function
-            return true;
-        }
+        // every digit was consumed, so the text is the formatted date exactly when the fields come back
+        int backYear, backMonth, backDay;
+        civilFromDays(day, backYear, backMonth, backDay);
+        *exact = backYear == year && backMonth == month && backDay == dayOfMonth;
     }
+    return true;
+}
 
-    return false;
+void PatientTable::reserve(size_t rows)
+{
+    idNumbers.reserve(rows);
+    idDigits.reserve(rows);
+    textFields.reserve(rows);
+    ages.reserve(rows);
+    dobDays.reserve(rows);
+    registrationDays.reserve(rows);
+    mobiles.reserve(rows);
+    female.reserve(rows / 64 + 1);
+    textStart.reserve(rows);
+    arena.reserve(rows * 24);
 }
 
-// Register new patient function
-void registerPatient(vector<Patient>& patients)
+void PatientTable::push_back(const Patient& p)
 {
-    Patient p;
-    cout<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*"<<endl;
-    cout<<"\n** PATIENT REGISTRATION WINDOW **" <<endl;
-    cout<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*"<<endl;
+    size_t row = size();
+    uint8_t fields = 0;
+    array<string_view, FIELD_COUNT> texts = {p.password, p.firstName, p.lastName};
+    size_t textCount = 3;
 
-    cout<<"Enter your first name: ";
-    cin >> p.firstName;
-    while (!validateName(p.firstName))
+    // every packed field is checked to come back exactly as written, otherwise it stays text
+    uint32_t number = 0;
+    size_t digits = p.patientId.size() - min<size_t>(3, p.patientId.size());
+    const char* digitsEnd = p.patientId.data() + p.patientId.size();
+    if (p.patientId.compare(0, 3, "PID") != 0 || digits < 1 || digits > 9 ||
+        from_chars(p.patientId.data() + 3, digitsEnd, number).ptr != digitsEnd || !isdigit(static_cast<unsigned char>(p.patientId[3])))
     {
-        cout<<"ERROR!. Please re-enter your first name: ";
-        cin >> p.firstName;
+        fields |= TEXT_ID;
+        texts[textCount++] = p.patientId;
+        number = 0;
+        digits = 0;
     }
-
-    cout<<"Enter your last name: ";
-    cin >> p.lastName;
-    while (!validateName(p.lastName))
+    int32_t dob = 0;
+    bool exact = false;
+    if (!parseBirthDay(p.dob, dob, &exact) || !exact)
     {
-        cout<<"ERROR!. Please re-enter your last name: ";
-        cin >> p.lastName;
+        fields |= TEXT_DOB;
+        texts[textCount++] = p.dob;
     }
-
-    cout<<"Enter your age: ";
-    cin >> p.age;
-    while (p.age <= 0)
+    int32_t registered = UNKNOWN_DAY;
+    if (!parseRegistrationDay(p.registrationDate, registered, &exact) || !exact)
     {
-        cout<<"ERROR!. Please re-enter your age: ";
-        cin >> p.age;
+        fields |= TEXT_REGISTRATION;
+        texts[textCount++] = p.registrationDate;
     }
-
-    cout<<"Enter your gender (M/F): ";
-    cin >> p.gender;
-    p.gender = toupper(p.gender);
-    while (p.gender != 'M' && p.gender != 'F')
+    char ageText[16];
+    if (p.age < 0 || p.age > 255)
+    {
+        fields |= TEXT_AGE;
+        texts[textCount++] = string_view(ageText, to_chars(ageText, ageText + sizeof(ageText), p.age).ptr - ageText);
+    }
+    if (p.gender != 'M' && p.gender != 'F')
+    {
+        fields |= TEXT_GENDER;
+        texts[textCount++] = string_view(&p.gender, 1);
+    }
+    uint64_t mobileNumber = 0;
+    if (!validateMobile(p.mobileNumber))
     {
-        cout<<"ERROR!. Please re-enter your gender (M/F): ";
-        cin >> p.gender;
-        p.gender = toupper(p.gender);
+        fields |= TEXT_MOBILE;
+        texts[textCount++] = p.mobileNumber;
+    }
+    else
+    {
+        mobileNumber = stoull(p.mobileNumber);
     }
 
-    cout<<"Enter your date of birth (DD/MM/YYYY): ";
-    cin >> p.dob;
-    while (!isValidDate(p.dob))
+    idNumbers.push_back(number);
+    idDigits.push_back(static_cast<uint8_t>(digits));
+    textFields.push_back(fields);
+    ages.push_back(static_cast<uint8_t>(fields & TEXT_AGE ? 0 : p.age));
+    dobDays.push_back(dob);
+    registrationDays.push_back(registered);
+    mobiles.push_back(mobileNumber);
+    if (row % 64 == 0)
+        female.push_back(0);
+    if (p.gender == 'F')
+        female[row / 64] |= uint64_t(1) << (row % 64);
+    textStart.push_back(arena.size());
+    for (size_t i = 0; i < textCount; ++i)
     {
-        cout<<"ERROR!. Please re-enter your date of birth (DD/MM/YYYY): ";
-        cin >> p.dob;
+        string_view t = texts[i];
+        arena.insert(arena.end(), t.begin(), t.end());
+        arena.push_back('\0');
     }
+}
 
-    cout<<"Enter your mobile number: ";
-    cin >> p.mobileNumber;
-    while (!validateMobile(p.mobileNumber))
+void PatientTable::append(PatientTable&& other)
+{
+    size_t base = arena.size();
+    size_t firstRow = size();
+    idNumbers.insert(idNumbers.end(), other.idNumbers.begin(), other.idNumbers.end());
+    idDigits.insert(idDigits.end(), other.idDigits.begin(), other.idDigits.end());
+    textFields.insert(textFields.end(), other.textFields.begin(), other.textFields.end());
+    ages.insert(ages.end(), other.ages.begin(), other.ages.end());
+    dobDays.insert(dobDays.end(), other.dobDays.begin(), other.dobDays.end());
+    registrationDays.insert(registrationDays.end(), other.registrationDays.begin(), other.registrationDays.end());
+    mobiles.insert(mobiles.end(), other.mobiles.begin(), other.mobiles.end());
+    for (uint64_t start : other.textStart)
+        textStart.push_back(base + start);
+    arena.insert(arena.end(), other.arena.begin(), other.arena.end());
+    // the bitmap of other starts on a word boundary, this one need not end on one
+    female.resize(size() / 64 + 1, 0);
+    for (size_t w = 0; w < other.female.size(); ++w)
     {
-        cout<<"ERROR!. Please re-enter your mobile number: ";
-        cin >> p.mobileNumber;
+        for (uint64_t bits = other.female[w]; bits != 0; bits &= bits - 1)
+        {
+            size_t row = firstRow + w * 64 + __builtin_ctzll(bits);
+            female[row / 64] |= uint64_t(1) << (row % 64);
+        }
     }
+    other = PatientTable();
+}
 
-    cout<<"Enter a password: ";
-    cin >> p.password;
+string_view PatientTable::text(size_t row, int index) const
+{
+    const char* p = arena.data() + textStart[row];
+    for (int i = 0; i < index; ++i)
+        p += strlen(p) + 1;
+    return string_view(p);
+}
 
-    string confirmPwd;
-    cout<<"Confirm your password: ";
-    cin >> confirmPwd;
-    while (confirmPwd != p.password)
-    {
-        cout<<"*******"<<endl;
-        cout<<"* PASSWORDS DO NOT MATCH . RE - ENTER! **"<<endl;
-        cout<<"*******"<<endl;
+bool PatientTable::idNumber(size_t row, uint32_t& number, int& digits) const
+{
+    if (textFields[row] & TEXT_ID)
+        return false;
+    number = idNumbers[row];
+    digits = idDigits[row];
+    return true;
+}
 
-        cout<<"\nRe-enter your password: ";
-        cin >> p.password;
-        cout<<"Confirm your password: ";
-        cin >> confirmPwd;
-    }
+string PatientTable::patientId(size_t row) const
+{
+    if (textFields[row] & TEXT_ID)
+        return string(textField(row, TEXT_ID));
+    char text[16];
+    snprintf(text, sizeof(text), "PID%0*u", static_cast<int>(idDigits[row]), idNumbers[row]);
+    return text;
+}
 
-    p.patientId = generatePatientId(patients);
-    time_t now = time(0);
-    char buf[100];
-    strftime(buf, sizeof(buf), "%Y/%m/%d", localtime(&now));
-    p.registrationDate = buf;
+int PatientTable::age(size_t row) const
+{
+    if (textFields[row] & TEXT_AGE)
+        return stoi(string(textField(row, TEXT_AGE)));
+    return ages[row];
+}
+
+char PatientTable::gender(size_t row) const
+{
+    if (textFields[row] & TEXT_GENDER)
+        return textField(row, TEXT_GENDER)[0];
+    return (female[row / 64] >> (row % 64)) & 1 ? 'F' : 'M';
+}
+
+bool PatientTable::mobile(size_t row, uint64_t& number) const
+{
+    number = mobiles[row];
+    return !(textFields[row] & TEXT_MOBILE);
+}
+
+string PatientTable::mobileNumber(size_t row) const
+{
+    if (textFields[row] & TEXT_MOBILE)
+        return string(textField(row, TEXT_MOBILE));
+    char text[24];
+    snprintf(text, sizeof(text), "%010llu", static_cast<unsigned long long>(mobiles[row]));
+    return text;
+}
 
-    patients.push_back(p);
-    writePatients(patients);
+Patient PatientTable::patient(size_t row) const
+{
+    Patient p;
+    p.patientId = patientId(row);
+    p.password = string(password(row));
+    p.firstName = string(firstName(row));
+    p.lastName = string(lastName(row));
+    p.dob = textFields[row] & TEXT_DOB ? string(textField(row, TEXT_DOB)) : formatBirthDay(dobDays[row]);
+    p.age = age(row);
+    p.gender = gender(row);
+    p.registrationDate = textFields[row] & TEXT_REGISTRATION ? string(textField(row, TEXT_REGISTRATION)) : formatRegistrationDay(registrationDays[row]);
+    p.mobileNumber = mobileNumber(row);
+    return p;
+}
 
-    cout<<"*******************************************************************************"<<endl;
-    cout<<"\n** R E G I S T R A T I O N   S U C C E S S F U L ! !   W E L C O M E, " << p.firstName << " **\n" <<endl;
-    cout<<"*******************************************************************************"<<endl;
+size_t PatientTable::memoryBytes() const
+{
+    return idNumbers.capacity() * sizeof(uint32_t) + idDigits.capacity() + textFields.capacity() + ages.capacity() +
+           (dobDays.capacity() + registrationDays.capacity()) * sizeof(int32_t) +
+           (mobiles.capacity() + female.capacity() + textStart.capacity()) * sizeof(uint64_t) + arena.capacity();
 }
 
-// Function to check if a symptom is present in a given list (case-insensitive)
-bool hasSymptom(const vector<string>& symptomsList, const string& symptom)
+void RowHashIndex::insert(uint64_t key, uint32_t row)
 {
-    string lowerSymptom = toLowercase(symptom);
-    for (const auto& s : symptomsList)
+    // at most three quarters full
+    if ((count + 1) * 4 > keys.size() * 3)
+        grow(max<size_t>(16, keys.size() * 2));
+    for (size_t i = slot(key);; i = (i + 1) & (keys.size() - 1))
     {
-        if (toLowercase(s) == lowerSymptom)
+        if (keys[i] == key + 1)
+            return;
+        if (keys[i] == 0)
         {
-            return true;
+            keys[i] = key + 1;
+            rows[i] = row;
+            count++;
+            return;
         }
     }
-    return false;
 }
 
-// Function to ask yes/no question and return true for 'yes' answers (case-insensitive)
-bool askYesNoQuestion(const string& question)
+bool RowHashIndex::find(uint64_t key, uint32_t& row) const
 {
-    string answer;
-    while (true)
+    if (keys.empty())
+        return false;
+    for (size_t i = slot(key);; i = (i + 1) & (keys.size() - 1))
     {
-        cout<<question << " (yes/no): ";
-        getline(cin, answer);
-        // Convert answer to lowercase before comparison
-        transform(answer.begin(), answer.end(), answer.begin(), ::tolower);
-        if (answer == "yes" || answer == "y")
+        if (keys[i] == key + 1)
         {
+            row = rows[i];
             return true;
         }
-        else if (answer == "no" || answer == "n")
-        {
+        if (keys[i] == 0)
             return false;
-        }
-        else
-        {
-            cout<<"Invalid input. Please enter 'yes' or 'no'." <<endl;
-        }
     }
 }
 
-// Function to prompt user for symptoms selection when no common symptoms match
-vector<string> selectSymptoms(const vector<string>& uncommonSymptoms)
+void RowHashIndex::clear()
 {
-    vector<string> selectedSymptoms;
-    string userInput;
+    keys.clear();
+    rows.clear();
+    count = 0;
+    bits = 0;
+}
 
-    cout<<"Please select the symptoms you are experiencing:" <<endl;
+void RowHashIndex::reserve(size_t expected)
+{
+    size_t slots = 16;
+    while (slots * 3 < expected * 4)
+        slots *= 2;
+    if (slots > keys.size())
+        grow(slots);
+}
 
-    // Display symptoms in a table format with three columns
-    const int numColumns = 3;
-    for (size_t i = 0; i < uncommonSymptoms.size(); ++i)
+void RowHashIndex::grow(size_t slots)
+{
+    vector<uint64_t> oldKeys(slots, 0);
+    vector<uint32_t> oldRows(slots, 0);
+    oldKeys.swap(keys);
+    oldRows.swap(rows);
+    bits = __builtin_ctzll(slots);
+    count = 0;
+    for (size_t i = 0; i < oldKeys.size(); ++i)
     {
-        cout<<setw(2) << i + 1 << ". " << setw(20) << left << uncommonSymptoms[i];
-        if ((i + 1) % numColumns == 0 || i == uncommonSymptoms.size() - 1)
-        {
-            cout<<endl;
-        }
-        else
-        {
-            cout<<"\t"; // Add tab character between columns
-        }
+        if (oldKeys[i] != 0)
+            insert(oldKeys[i] - 1, oldRows[i]);
     }
+}
 
-    while (true)
-    {
-        cout<<"Enter the numbers corresponding to the selected symptoms (separated by spaces): ";
-        getline(cin, userInput);
-
-        istringstream iss(userInput);
-        int number;
-        bool validInput = true;
+// Marks an empty slot of PatientRepository::rowByIdNumber
+const uint32_t NO_ROW = UINT32_MAX;
+// IDs up to this number, or up to four times the number of patients, are indexed in the flat array
+const uint32_t ID_ARRAY_MIN_SPAN = 1 << 20;
 
-        while (iss >> number)
-        {
-            if (number > 0 && number <= static_cast<int>(uncommonSymptoms.size()))
-            {
-                selectedSymptoms.push_back(uncommonSymptoms[number - 1]);
-            }
-            else
-            {
-                cout<<"Invalid selection. Please enter valid numbers from the menu." <<endl;
-                validInput = false;
-                selectedSymptoms.clear(); // Clear any previously selected symptoms
-                break;
-            }
-        }
+PatientRepository::PatientRepository(const vector<Patient>& loaded)
+{
+    table.reserve(loaded.size());
+    for (const Patient& p : loaded)
+        table.push_back(p);
+    reindex();
+}
 
-        // Check if input was valid (no letters or special characters)
-        if (validInput)
-        {
-            // If all numbers were valid, break out of the loop
-            break;
-        }
+void PatientRepository::reindex()
+{
+    rowByIdNumber.clear();
+    otherIds.clear();
+    byMobile.clear();
+    otherMobiles.clear();
+    maxId = 0;
+    byMobile.reserve(table.size());
+    byAge.assign(MAX_INDEXED_AGE + 1, {});
+    byRegistration.clear();
+    byRegistration.reserve(table.size());
+    byGender.clear();
+    reindexing = true;
+    for (size_t row = 0; row < table.size(); ++row)
+    {
+        index(row);
     }
-
-    return selectedSymptoms;
+    reindexing = false;
+    if (!is_sorted(byRegistration.begin(), byRegistration.end()))
+        sort(byRegistration.begin(), byRegistration.end());
 }
 
-// Function to prompt user for symptoms and filter diseases based on symptoms
-vector<Disease> identifyDiseases(const vector<Disease>& diseases)
+void PatientRepository::index(size_t row)
 {
-    vector<Disease> matchingDiseases;
-
-    // Common symptoms
-    vector<string> commonSymptoms = {"fever", "body ache", "sore throat", "cold", "cough", "stomach ache", "fatigue"};
-    vector<string> userSymptoms;
-
-    // Ask about common symptoms
-    cout<<"************************************"<<endl;
-    cout<<"** DISEASE IDENTIFICATION WINDOW ***"<<endl;
-    cout<<"************************************"<<endl;
-    cout<<"\nLet's check for common symptoms:" <<endl;
-    for (const auto& symptom : commonSymptoms)
+    uint32_t number;
+    int digits;
+    bool indexed = false;
+    if (table.idNumber(row, number, digits))
     {
-        if (askYesNoQuestion("Do you have " + symptom + "?"))
+        // the flat array only grows in proportion to the store, a far off number goes to the map
+        if (number >= rowByIdNumber.size() && number < max<size_t>(ID_ARRAY_MIN_SPAN, table.size() * 4))
+            rowByIdNumber.resize(max<size_t>(number + 1, rowByIdNumber.size() * 2), NO_ROW);
+        if (number < rowByIdNumber.size() && rowByIdNumber[number] == NO_ROW)
         {
-            userSymptoms.push_back(symptom);
+            rowByIdNumber[number] = static_cast<uint32_t>(row);
+            indexed = true;
         }
+        maxId = max(maxId, static_cast<int>(number));
     }
-
-    // If less than two common symptoms selected, ask for specific symptoms
-    if (userSymptoms.size() <= 1)
+    if (!indexed)
     {
-        cout<<"\n - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - "<<endl;
-        cout<<"Less than two common symptoms selected. Please select from uncommon symptoms." <<endl;
-        // List uncommon symptoms
-        vector<string> uncommonSymptoms;
-        for (const auto& disease : diseases)
+        string id = table.patientId(row);
+        otherIds.emplace(id, static_cast<uint32_t>(row));
+        // numeric suffix after "PID", IDs not following the pattern do not take part
+        if (id.size() > 3 && isNumeric(id.substr(3)) && id.size() - 3 < 10)
         {
-            for (const auto& symptom : disease.symptoms)
-            {
-                if (!hasSymptom(commonSymptoms, symptom) && find(uncommonSymptoms.begin(), uncommonSymptoms.end(), symptom) == uncommonSymptoms.end())
-                {
-                    uncommonSymptoms.push_back(symptom);
-                }
-            }
+            maxId = max(maxId, stoi(id.substr(3)));
         }
+    }
 
-        // Check if there are any uncommon symptoms available
-        if (uncommonSymptoms.empty())
-        {
-            cout<<"\nNo uncommon symptoms available for selection."<<endl;
-            cout<<"******** E X I T I N G ********"<<endl;
-            return matchingDiseases; // Return an empty list of diseases
-        }
+    uint64_t mobile;
+    if (table.mobile(row, mobile))
+        byMobile.insert(mobile, static_cast<uint32_t>(row));
+    else
+        otherMobiles.emplace(table.mobileNumber(row), static_cast<uint32_t>(row));
 
-        // Let user select symptoms from uncommon list
-        vector<string> selectedUncommonSymptoms = selectSymptoms(uncommonSymptoms);
-        // Combine common and uncommon symptoms
-        userSymptoms.insert(userSymptoms.end(), selectedUncommonSymptoms.begin(), selectedUncommonSymptoms.end());
-    }
+    if (byAge.empty())
+        byAge.resize(MAX_INDEXED_AGE + 1);
+    byAge[min(max(table.age(row), 0), MAX_INDEXED_AGE)].push_back(static_cast<uint32_t>(row));
 
-    // Filter diseases based on user symptoms
-    for (const auto& disease : diseases)
-    {
-        int matchedSymptomCount = 0;
-        for (const auto& userSymptom : userSymptoms)
-        {
-            if (hasSymptom(disease.symptoms, userSymptom))
-            {
-                matchedSymptomCount++;
-            }
-        }
-        // Add disease to matchingDiseases if it matches at least one symptom
-        if (matchedSymptomCount > 0)
-        {
-            matchingDiseases.push_back(disease);
-        }
-    }
-    return matchingDiseases;
+    // patients are mostly added in registration order, so this is nearly always an append
+    pair<int32_t, uint32_t> entry(table.registrationDay(row), static_cast<uint32_t>(row));
+    if (byRegistration.empty() || byRegistration.back() < entry || reindexing)
+        byRegistration.push_back(entry); // reindex() sorts them all at the end
+    else
+        byRegistration.insert(upper_bound(byRegistration.begin(), byRegistration.end(), entry), entry);
+
+    vector<uint64_t>& bits = byGender[table.gender(row)];
+    bits.resize(table.size() / 64 + 1, 0);
+    bits[row / 64] |= uint64_t(1) << (row % 64);
 }
 
-// Function to display detailed information about a disease
-void viewDiseaseDetails(const Disease& disease, unordered_set<string>& viewedDiseases)
+bool PatientRepository::matches(size_t row, const PatientQuery& q) const
 {
-    cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -" <<endl;
-    cout<<"D I S E A S E: " << disease.name <<endl;
-    cout<<"\nS Y M P T O M S: ";
-    for (const auto& symptom : disease.symptoms)
+    int age = table.age(row);
+    int32_t day = table.registrationDay(row);
+    bool datedQuery = q.firstRegistrationDay != INT32_MIN || q.lastRegistrationDay != INT32_MAX;
+    if (age < q.minAge || age > q.maxAge)
+        return false;
+    if (datedQuery && (day == UNKNOWN_DAY || day < q.firstRegistrationDay || day > q.lastRegistrationDay))
+        return false;
+    if (q.gender != 0)
     {
-        cout<<symptom << ", ";
+        auto it = byGender.find(q.gender);
+        if (it == byGender.end() || row / 64 >= it->second.size() || !((it->second[row / 64] >> (row % 64)) & 1))
+            return false;
     }
-    cout<<endl;
-    cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -" <<endl;
-
-    // Add disease name to viewed set
-    viewedDiseases.insert(disease.name);
+    return true;
 }
 
-// Function to display personal information of the logged-in user
-void displayPersonalInformation(const string& loggedInPatientId, const vector<Patient>& patients)
+vector<string> PatientRepository::query(const PatientQuery& q) const
 {
-    // Find the patient with the logged-in ID
-    auto it = find_if(patients.begin(), patients.end(), [&](const Patient& p) { return p.patientId == loggedInPatientId; });
+    vector<string> ids;
+    if (q.minAge > q.maxAge || q.firstRegistrationDay > q.lastRegistrationDay)
+        return ids;
 
-    if (it != patients.end())
+    // size of the row set each indexed condition selects
+    int firstAge = min(max(q.minAge, 0), MAX_INDEXED_AGE);
+    int lastAge = min(max(q.maxAge, 0), MAX_INDEXED_AGE);
+    size_t ageRows = 0;
+    for (int age = firstAge; age <= lastAge; ++age)
+        ageRows += byAge[age].size();
+    // without a date condition the index is the whole table, patients of an unknown day included
+    bool datedQuery = q.firstRegistrationDay != INT32_MIN || q.lastRegistrationDay != INT32_MAX;
+    auto firstDay = byRegistration.begin();
+    auto lastDay = byRegistration.end();
+    if (datedQuery)
     {
-        const Patient& patient = *it;
-
-        // Display personal information
-        cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
-        cout<<"\n     P E R S O N A L    I N F O R M A T I O N :    "<<endl;
-        cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
-        cout<<"Patient ID: " << patient.patientId <<endl;
-        cout<<"First Name: " << patient.firstName <<endl;
-        cout<<"Last Name: " << patient.lastName <<endl;
-        cout<<"Date of Birth: " << patient.dob <<endl;
-        cout<<"Age: " << patient.age <<endl;
-        cout<<"Gender: " << patient.gender <<endl;
-        cout<<"Mobile Number: " << patient.mobileNumber <<endl;
-        cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+        firstDay = lower_bound(byRegistration.begin(), byRegistration.end(), make_pair(max(q.firstRegistrationDay, UNKNOWN_DAY + 1), uint32_t(0)));
+        lastDay = upper_bound(byRegistration.begin(), byRegistration.end(), make_pair(q.lastRegistrationDay, UINT32_MAX));
+    }
+    size_t dayRows = static_cast<size_t>(lastDay - firstDay);
+    size_t genderRows = table.size();
+    const vector<uint64_t>* genderBits = nullptr;
+    if (q.gender != 0)
+    {
+        auto it = byGender.find(q.gender);
+        if (it == byGender.end())
+            return ids;
+        genderBits = &it->second;
+        genderRows = 0;
+        for (uint64_t word : *genderBits)
+            genderRows += __builtin_popcountll(word);
+    }
 
+    // candidates from the most selective condition, checked against all of them; the registration index
+    // yields them in registration order, the others in row order
+    vector<uint32_t> rows;
+    bool registrationOrder = dayRows <= ageRows && dayRows <= genderRows;
+    if (registrationOrder)
+    {
+        rows.reserve(dayRows);
+        for (auto it = firstDay; it != lastDay; ++it)
+            if (matches(it->second, q))
+                rows.push_back(it->second);
+    }
+    else if (ageRows <= genderRows)
+    {
+        rows.reserve(ageRows);
+        for (int age = firstAge; age <= lastAge; ++age)
+            for (uint32_t row : byAge[age])
+                if (matches(row, q))
+                    rows.push_back(row);
+    }
+    else if (genderBits)
+    {
+        for (size_t w = 0; w < genderBits->size(); ++w)
+            for (uint64_t word = (*genderBits)[w]; word != 0; word &= word - 1)
+            {
+                size_t row = w * 64 + __builtin_ctzll(word);
+                if (matches(row, q))
+                    rows.push_back(static_cast<uint32_t>(row));
+            }
     }
     else
     {
-        cout<<"*************"<<endl;
-        cout<<"--------* PATIENT NOT FOUND! ---------"<<endl;
-        cout<<"*************"<<endl;
+        for (size_t row = 0; row < table.size(); ++row)
+            if (matches(row, q))
+                rows.push_back(static_cast<uint32_t>(row));
     }
+    if (!registrationOrder)
+        sort(rows.begin(), rows.end(), [this](uint32_t a, uint32_t b) {
+            return make_pair(table.registrationDay(a), a) < make_pair(table.registrationDay(b), b);
+        });
+
+    ids.reserve(rows.size());
+    for (uint32_t row : rows)
+        ids.push_back(table.patientId(row));
+    return ids;
 }
 
-// Function to suggest tests based on symptoms
-void suggestTests(const vector<string>& symptoms)
+// Registrations logged since the last compaction before the snapshot is rewritten; grows with the store so
+// the cost of rewriting it stays constant per registration
+const size_t LOG_COMPACT_MIN_RECORDS = 1000;
+
+PatientRepository::~PatientRepository()
 {
-    cout<<"\nBased on your symptoms, the following tests are suggested:" <<endl;
-    cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+    if (compactor.joinable())
+        compactor.join();
+}
+
+bool PatientRepository::open(const string& snapshotPath, const string& logPath)
+{
+    snapshotFile = snapshotPath;
+    retiredLogFile = logPath + ".old";
+    table = PatientTable();
+    readPatientRows(snapshotPath, 0, table);
+    reindex();
 
-    // Check if symptoms indicate potential heart disease
-    if (find(symptoms.begin(), symptoms.end(), "chest pain") != symptoms.end() &&
-        find(symptoms.begin(), symptoms.end(), "shortness of breath") != symptoms.end())
+    // a log retired by an unfinished compaction comes before the current one
+    vector<Patient> replayed;
+    PatientLog retired;
+    struct stat st;
+    bool hasRetired = stat(retiredLogFile.c_str(), &st) == 0;
+    if (hasRetired && !retired.open(retiredLogFile, replayed))
+        return false;
+    retired.close();
+    if (!log.open(logPath, replayed))
+        return false;
+    for (const Patient& p : replayed)
     {
-        cout<<"- Electrocardiogram (ECG)" <<endl;
-        cout<<"- Echocardiogram (Echo)" <<endl;
+        // after a crash between writing a snapshot and emptying the log, records are already in the snapshot
+        if (findById(p.patientId) == NO_PATIENT)
+        {
+            table.push_back(p);
+            index(table.size() - 1);
+        }
     }
+    if (hasRetired || compactionDue())
+        compact();
+    return true;
+}
+
+size_t PatientRepository::add(const Patient& p)
+{
+    // a registration that is not in the log would be gone after a restart
+    if (log.isOpen() && !log.append(p))
+        return NO_PATIENT;
+    table.push_back(p);
+    index(table.size() - 1);
+    return table.size() - 1;
+}
+
+bool PatientRepository::compactionDue() const
+{
+    return log.isOpen() && log.records() >= max(LOG_COMPACT_MIN_RECORDS, table.size() / 4);
+}
+
+bool PatientRepository::compact()
+{
+    if (compactor.joinable())
+        finishCompaction();
+    // the logs are only emptied once the new snapshot is durable and in place
+    StageTimer timer(Stage::WritePatients);
+    log.sync();
+    bool written = writeFileDurably(snapshotFile, [&](ostream& file) {
+        for (size_t row = 0; row < table.size(); ++row)
+            file << formatPatient(table.patient(row)) << '\n';
+    });
+    if (!written)
+        return false;
+    remove(retiredLogFile.c_str());
+    return log.truncate();
+}
 
-    // Check if symptoms suggest possible diabetes mellitus
-    if (find(symptoms.begin(), symptoms.end(), "increased thirst") != symptoms.end() &&
-        find(symptoms.begin(), symptoms.end(), "frequent urination") != symptoms.end())
+void PatientRepository::compactInBackground()
+{
+    if (compactor.joinable())
     {
-        cout<<"- Fasting Plasma Glucose Test" <<endl;
-        cout<<"- Oral Glucose Tolerance Test (OGTT)" <<endl;
+        if (!compactionFinished.load(memory_order_acquire))
+            return;
+        finishCompaction();
     }
-
-    // Check if symptoms are indicative of respiratory infections
-    if (find(symptoms.begin(), symptoms.end(), "fever") != symptoms.end() &&
-        find(symptoms.begin(), symptoms.end(), "cough") != symptoms.end() &&
-        find(symptoms.begin(), symptoms.end(), "difficulty breathing") != symptoms.end())
+    if (!compactionDue())
+        return;
+    // after a failed compaction the retired log still holds records the snapshot lacks, so it is kept
+    // and the current log goes on; records it shares with the new snapshot are skipped on replay
+    struct stat st;
+    if (stat(retiredLogFile.c_str(), &st) != 0 && !log.retire(retiredLogFile))
     {
-        cout<<"- Chest X-ray" <<endl;
-        cout<<"- Pulmonary Function Tests (PFTs)" <<endl;
+        cerr<<"WARNING! Could not retire the registration log for compaction" <<endl;
+        return;
     }
+    // copying the packed rows is a few memcpy calls; formatting and syncing them is left to the thread
+    compactionFinished.store(false, memory_order_relaxed);
+    compactor = thread([this, rows = table] {
+        StageTimer timer(Stage::WritePatients);
+        bool written = writeFileDurably(snapshotFile, [&](ostream& file) {
+            for (size_t row = 0; row < rows.size(); ++row)
+                file << formatPatient(rows.patient(row)) << '\n';
+        });
+        compactionSucceeded = written && remove(retiredLogFile.c_str()) == 0;
+        compactionFinished.store(true, memory_order_release);
+    });
+}
+
+void PatientRepository::finishCompaction()
+{
+    compactor.join();
+    if (!compactionSucceeded)
+        cerr<<"WARNING! Could not write the patient snapshot, " << retiredLogFile << " is kept until the next compaction" <<endl;
+}
 
-    // If no specific patterns matched, suggest general tests
-    if (symptoms.size() >= 3)
+size_t PatientRepository::findById(const string& patientId) const
+{
+    // PID<n> is looked up by n, and must also be written with the same digits
+    uint32_t number = 0;
+    const char* digitsEnd = patientId.data() + patientId.size();
+    if (patientId.size() > 3 && patientId.size() <= 12 && patientId.compare(0, 3, "PID") == 0 && isdigit(static_cast<unsigned char>(patientId[3])) &&
+        from_chars(patientId.data() + 3, digitsEnd, number).ptr == digitsEnd && number < rowByIdNumber.size() && rowByIdNumber[number] != NO_ROW)
     {
-        cout<<"- Complete Blood Count (CBC)" <<endl;
-        cout<<"- Urine Analysis" <<endl;
+        uint32_t row = rowByIdNumber[number];
+        uint32_t rowNumber;
+        int digits;
+        if (table.idNumber(row, rowNumber, digits) && digits == static_cast<int>(patientId.size() - 3))
+            return row;
     }
-    cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+    auto it = otherIds.find(patientId);
+    return it == otherIds.end() ? NO_PATIENT : it->second;
 }
-// Bill Calculation
-double calculateBill(int numPredicted, int numDetailsDisplayed, int numMedicationsDisplayed, int numYesResponses)
+
+size_t PatientRepository::findByLogin(const string& idOrMobile) const
 {
-    //Price per service availed:
-    const double predictionFee = 100.0; // Fee per disease prediction
-    const double detailsFee = 50.0;     // Fee per disease details viewed
-    const double medicationFee = 30.0;  // Fee per medication details viewed
-    const double yesResponseFee = 45.0; // Fee per "yes" response
+    size_t row = findById(idOrMobile);
+    if (row != NO_PATIENT)
+    {
+        return row;
+    }
+    uint32_t mobileRow;
+    if (validateMobile(idOrMobile))
+        return byMobile.find(stoull(idOrMobile), mobileRow) ? mobileRow : NO_PATIENT;
+    auto it = otherMobiles.find(idOrMobile);
+    return it == otherMobiles.end() ? NO_PATIENT : it->second;
+}
 
-    //total bill calculation-
-    double totalBill = predictionFee * numPredicted + detailsFee * numDetailsDisplayed + medicationFee * numMedicationsDisplayed + yesResponseFee * numYesResponses;
+size_t PatientRepository::memoryBytes() const
+{
+    size_t bytes = table.memoryBytes() + rowByIdNumber.capacity() * sizeof(uint32_t) + byMobile.memoryBytes() +
+                   byRegistration.capacity() * sizeof(pair<int32_t, uint32_t>);
+    for (const auto& rows : byAge)
+        bytes += rows.capacity() * sizeof(uint32_t);
+    for (const auto& entry : byGender)
+        bytes += entry.second.capacity() * sizeof(uint64_t);
+    // hash map nodes, roughly: key, row, next pointer and a bucket
+    bytes += (otherIds.size() + otherMobiles.size()) * (sizeof(string) + 24);
+    return bytes;
+}
 
-    return totalBill;
+string PatientRepository::nextPatientId() const
+{
+    if (table.size() == 0)
+    {
+        //the values of repeated 0 do not make a diff, the ID will work if PID01 is also entered.
+        return "PID000001";
+    }
+    //addition of numeric value (the suffix) by 1 for unique ID for each patient.
+    return "PID" + to_string(maxId + 1);
 }
 
+// Generates unique patient ID, with the pattern of PID0000 XX
+string generatePatientId(const PatientRepository& patients)
+{
+    return patients.nextPatientId();
+}
 
-// Function to provide details of the doctor to consult
-void provideDoctorDetails()
+// Formats a patient as one tab separated line of patients.txt, without the newline
+string formatPatient(const Patient& p)
 {
-    cout<<"\nFor further diagnosis and consultation, it is recommended to see a general practitioner or an internist." <<endl;
-    cout<<"You can visit your nearest health-care center or consult a doctor online." <<endl;
+    return p.patientId + "\t" + p.password + "\t" + p.firstName + "\t" + p.lastName + "\t" + p.dob + "\t" + to_string(p.age) + "\t" + p.gender + "\t" + p.registrationDate + "\t" + p.mobileNumber;
 }
 
-// Function to calculate change for cash payment
-bool calculateChange(double billAmount, double cashAmount)
+// Parses one line of patients.txt (without the newline), returns false if fields are missing.
+// Fields are split on tabs with memchr and the age is parsed with from_chars, so nothing is copied but the
+// field values themselves, and names may contain spaces.
+bool parsePatient(string_view line, Patient& p)
 {
-    // Ensure cash amount is greater than or equal to bill amount
-    if (cashAmount < billAmount)
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+
+    const int numFields = 9;
+    string_view fields[numFields];
+    const char* pos = line.data();
+    const char* end = line.data() + line.size();
+    for (int i = 0; i < numFields; ++i)
     {
-        std::cout<<"Error: Insufficient cash provided." << std::endl;
-        return false;
+        const char* tab = (i + 1 < numFields) ? static_cast<const char*>(memchr(pos, '\t', end - pos)) : end;
+        if (tab == nullptr)
+            return false;
+        fields[i] = string_view(pos, tab - pos);
+        pos = tab + 1;
     }
 
-    // Calculate change
-    double change = cashAmount - billAmount;
-
-    // Output change
-    std::cout<<"Change: Rs. " << std::fixed << std::setprecision(2) << change << std::endl;
+    //data of patients is stored in a structure of the same name.
+    auto ageResult = from_chars(fields[5].data(), fields[5].data() + fields[5].size(), p.age);
+    if (fields[0].empty() || fields[6].empty() || ageResult.ec != errc() || ageResult.ptr != fields[5].data() + fields[5].size())
+        return false;
+    p.patientId.assign(fields[0].data(), fields[0].size());
+    p.password.assign(fields[1].data(), fields[1].size());
+    p.firstName.assign(fields[2].data(), fields[2].size());
+    p.lastName.assign(fields[3].data(), fields[3].size());
+    p.dob.assign(fields[4].data(), fields[4].size());
+    p.gender = fields[6][0];
+    p.registrationDate.assign(fields[7].data(), fields[7].size());
+    p.mobileNumber.assign(fields[8].data(), fields[8].size());
     return true;
 }
 
-// Function to simulate an Online payment transaction with bank details
-bool processOnlinePayment(double billAmount)
+// Parses every complete line in [first, last) and appends the patients to out, a vector<Patient> or a PatientTable
+template <typename Rows>
+void parsePatientLines(const char* first, const char* last, Rows& out)
 {
-    // Allowed bank names
-    vector<string> bnk_names = {"ICICI Bank", "SBI", "Bank of Baroda", "Axis Bank", "HDFC Bank", "Kotak Mahindra Bank", "IDFC Bank"};
+    Patient p;
+    while (first < last)
+    {
+        const char* newline = static_cast<const char*>(memchr(first, '\n', last - first));
+        const char* lineEnd = newline ? newline : last;
+        if (parsePatient(string_view(first, lineEnd - first), p))
+        {
+            out.push_back(p);
+        }
+        first = lineEnd + 1;
+    }
+}
 
-    // Bank details
-    cout<<"Enter your bank details for Online payment:" <<endl;
+// Directory part of a path, for syncing a rename
+string parentDirectory(const string& path)
+{
+    size_t slash = path.rfind('/');
+    return slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+}
 
-    string bankName;
-    cout<<"Bank Name: ";
-    getline(cin, bankName);
-
-    string uppercaseBankName = toUppercase(bankName);
-
-    // Check if the entered bank name matches any allowed bank name or its substring
-    bool validBank = false;
-    for (const string& bnk : bnk_names) {
-        string uppercaseBnk = toUppercase(bnk);
-        if (uppercaseBankName.find(uppercaseBnk) != string::npos || uppercaseBnk.find(uppercaseBankName) != string::npos) {
-            validBank = true;
-            bankName = bnk; // Set bank name to the full name from the list
-            break;
-        }
+// Renames a fully written and synced temporary file over path, and makes the rename durable
+bool replaceFile(const string& tmpPath, const string& path)
+{
+    if (rename(tmpPath.c_str(), path.c_str()) != 0)
+        return false;
+    int dirFd = ::open(parentDirectory(path).c_str(), O_RDONLY);
+    if (dirFd >= 0)
+    {
+        fsync(dirFd);
+        ::close(dirFd);
+    }
+    return true;
+}
+
+// Writes a file through a temporary file that is synced and then renamed over path, so a crash leaves
+// either the old or the new file, never a half written one
+bool writeFileDurably(const string& path, const function<void(ostream&)>& write)
+{
+    string tmpPath = path + ".tmp";
+    ofstream file(tmpPath, ios::trunc);
+    if (!file.is_open())
+        return false;
+    write(file);
+    file.close();
+    if (!file)
+    {
+        remove(tmpPath.c_str());
+        return false;
     }
 
-    if (!validBank) {
-        cout<<"Invalid bank name. Please enter a valid bank name from the list." <<endl;
+    int fd = ::open(tmpPath.c_str(), O_RDONLY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0)
+        ::close(fd);
+    if (!synced || !replaceFile(tmpPath, path))
+    {
+        remove(tmpPath.c_str());
         return false;
     }
+    return true;
+}
+
+// Writes all patients as a new snapshot
+bool writePatients(const vector<Patient>& patients, const string& path)
+{
+    StageTimer timer(Stage::WritePatients);
+    return writeFileDurably(path, [&](ostream& file) {
+        for (const Patient& p : patients)
+        {
+            file << formatPatient(p) << '\n';
+        }
+    });
+}
 
-    string accountNumber;
-    cout<<"Account Number: ";
-    getline(cin, accountNumber);
+// Files smaller than this are always parsed on one thread, starting threads would cost more than it saves
+const size_t PARALLEL_LOAD_MIN_BYTES = 8 << 20;
 
-    string cvv;
-    cout<<"CVV: ";
-    getline(cin, cvv);
+// Joins the rows parsed by one loading thread to the rows already loaded
+void appendRows(vector<Patient>& rows, vector<Patient>&& chunk)
+{
+    move(chunk.begin(), chunk.end(), back_inserter(rows));
+}
 
-    // Payment processing simulation-
-    cout<<"Processing Online Payment through " << bankName << " bank..." <<endl;
-    cout<<"\nPlease wait while we connect you to the " << bankName << " payment gateway." <<endl;
-    cout<<"\nPayment authorization in progress..." <<endl;
+void appendRows(PatientTable& rows, PatientTable&& chunk)
+{
+    rows.append(move(chunk));
+}
 
-    bool paymentSuccess = true;
+// Reads patient data from file and appends it to rows, a vector<Patient> or a PatientTable.
+// The file is memory-mapped and parsed in place. threads = 0 picks one thread per core for large files;
+// the file is then cut into chunks at line boundaries that are parsed in parallel and joined in file order.
+template <typename Rows>
+void readPatientRows(const string& path, unsigned threads, Rows& rows)
+{
+    StageTimer timer(Stage::ReadPatients);
+    //text file reading
+    MappedFile file;
+    if (!file.open(path) || file.size() == 0)
+        return;
 
-    if (paymentSuccess)
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+    if (threads == 0)
+        threads = file.size() < PARALLEL_LOAD_MIN_BYTES ? 1 : max(1u, thread::hardware_concurrency());
+    if (threads == 1)
     {
-        cout<<"Payment of Rs. " << fixed << setprecision(2) << billAmount << " through " << bankName << " bank is successful." <<endl;
+        rows.reserve(rows.size() + file.size() / 64);
+        parsePatientLines(begin, end, rows);
+        return;
     }
-    else
+
+    // chunk boundaries are moved forward to the next line start
+    vector<const char*> bounds = {begin};
+    for (unsigned i = 1; i < threads; ++i)
     {
-        cout<<"Payment through " << bankName << " bank failed. Please try again later or choose a different payment method." <<endl;
-        cout<<"Attempting payment again..." <<endl;
+        const char* cut = max(bounds.back(), begin + file.size() * i / threads);
+        const char* newline = cut < end ? static_cast<const char*>(memchr(cut, '\n', end - cut)) : nullptr;
+        bounds.push_back(newline ? newline + 1 : end);
+    }
+    bounds.push_back(end);
+
+    vector<Rows> chunks(threads);
+    vector<thread> workers;
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers.emplace_back([&, i] {
+            chunks[i].reserve((bounds[i + 1] - bounds[i]) / 64);
+            parsePatientLines(bounds[i], bounds[i + 1], chunks[i]);
+        });
+    }
+    size_t total = rows.size();
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers[i].join();
+        total += chunks[i].size();
+    }
+    rows.reserve(total);
+    for (auto& chunk : chunks)
+    {
+        appendRows(rows, move(chunk));
+    }
+}
 
-        // Retry payment
-        cout<<"Processing Online Payment through " << bankName << " bank..." <<endl;
-        cout<<"\nPlease wait while we connect you to the " << bankName << " payment gateway." <<endl;
-        cout<<"\nPayment authorization in progress..." <<endl;
+// Reads patient data from file and adds it into a vector.
+vector<Patient> readPatients(const string& path, unsigned threads)
+{
+    vector<Patient> patients;
+    readPatientRows(path, threads, patients);
+    return patients;
+}
 
-        // Second attempt
-        paymentSuccess = (rand() % 2 == 0); // Randomly choose success or failure
-        if (paymentSuccess)
+// CRC-32 (IEEE) of a string, used to detect torn or damaged log records
+uint32_t crc32(string_view data)
+{
+    static const vector<uint32_t> table = [] {
+        vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i)
         {
-            cout<<"Second attempt successful! Payment of Rs. " << fixed << setprecision(2) << billAmount << " through " << bankName << " bank is successful." <<endl;
-            return true;
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
         }
-        else
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (unsigned char ch : data)
+        crc = table[(crc ^ ch) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Records pending before the log is synced, and the longest a record may wait for it
+const size_t LOG_SYNC_BATCH = 32;
+const int LOG_SYNC_INTERVAL_MS = 200;
+
+bool PatientLog::open(const string& logPath, vector<Patient>& replayed)
+{
+    close();
+    recordCount = 0;
+    // recovery: keep every record up to the first one that is torn or fails its checksum
+    off_t validBytes = 0;
+    ifstream file(logPath, ios::binary);
+    if (file.is_open())
+    {
+        string line;
+        while (getline(file, line))
         {
-            cout<<"Second attempt failed. Payment through " << bankName << " bank failed again. Please try again later or choose a different payment method." <<endl;
-            return false;
+            if (file.eof())
+                break; // no newline, the record was torn by a crash
+            Patient p;
+            if (line.size() < 10 || line[8] != '\t' || !isxdigit(static_cast<unsigned char>(line[0])) ||
+                strtoul(line.substr(0, 8).c_str(), nullptr, 16) != crc32(line.substr(9)) || !parsePatient(line.substr(9), p))
+                break;
+            replayed.push_back(p);
+            recordCount++;
+            validBytes += line.size() + 1;
         }
+        file.close();
+    }
+
+    path = logPath;
+    fd = ::open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, validBytes) != 0)
+    {
+        close();
+        return false;
     }
+    length = validBytes;
+    lastSync = chrono::steady_clock::now();
+    return true;
 }
 
-// to store the feedback given by the user.
-struct Feedback
+bool PatientLog::append(const Patient& p)
 {
-    int overallExperienceRating;
-    string improvementSuggestions;
-    bool concernsAddressed;
-    bool enoughInformationProvided;
-    bool treatmentEffective;
-    bool sideEffectsExperienced;
-    string additionalComments;
-};
+    string fields = formatPatient(p);
+    char checksum[10];
+    snprintf(checksum, sizeof(checksum), "%08x\t", crc32(fields));
+    string record = checksum + fields + "\n";
+    // one write per record, so the record is never interleaved with another append
+    ssize_t written = write(fd, record.data(), record.size());
+    if (written != static_cast<ssize_t>(record.size()))
+    {
+        // recovery stops at a torn record, so a partial one must not stay in front of later appends
+        if (written > 0 && ftruncate(fd, length) != 0)
+            cerr<<"WARNING! Could not cut a partial record off the registration log" <<endl;
+        return false;
+    }
+    length += written;
+    recordCount++;
+    pending++;
+    if (pending >= LOG_SYNC_BATCH || chrono::steady_clock::now() - lastSync >= chrono::milliseconds(LOG_SYNC_INTERVAL_MS))
+    {
+        sync();
+    }
+    return true;
+}
 
-// Function to provide Feedback
-void provideFeedback(Feedback &feedback)
+void PatientLog::sync()
 {
-    cout<<"****************\n";
-    cout<<"*      F E E D B A C K   W I N D O W       *\n";
-    cout<<"****************\n\n";
-
-    cout<<"\nThank you for choosing to provide feedback!" <<endl;
-    cout<<"Please answer the following questions:\n" <<endl;
-
-    cout<<"------------------------------------------------" <<endl;
-    cout<<"How would you rate your overall experience out of 5? ";
-    cin >> feedback.overallExperienceRating;
-    cin.ignore();
-
-    cout<<"------------------------------------------------" <<endl;
-    cout<<"Do you have any suggestions for improvement? (yes/no): ";
-    string response;
-    cin >> response;
-    if (response == "yes" || response == "y")
+    if (fd >= 0 && pending > 0)
     {
-        cout<<"Please provide your suggestions: ";
-        cin.ignore();
-        getline(cin, feedback.improvementSuggestions);
+        fdatasync(fd);
+        pending = 0;
     }
+    lastSync = chrono::steady_clock::now();
+}
+
+bool PatientLog::truncate()
+{
+    if (fd < 0 || ftruncate(fd, 0) != 0)
+        return false;
+    fdatasync(fd);
+    length = 0;
+    recordCount = 0;
+    pending = 0;
+    return true;
+}
 
-    cout<<"------------------------------------------------" <<endl;
-    cout<<"Were your concerns addressed adequately? (yes/no): ";
-    cin >> response;
-    feedback.concernsAddressed = (response == "yes" || response == "y");
-    if (!feedback.concernsAddressed)
+bool PatientLog::retire(const string& retiredPath)
+{
+    if (fd < 0)
+        return false;
+    sync();
+    // the open descriptor follows the rename, the new log is a new file under the old name
+    if (!replaceFile(path, retiredPath))
+        return false;
+    int next = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (next < 0)
     {
-        cout<<"Please provide the reason for your concerns: ";
-        cin.ignore();
-        getline(cin, response);
+        replaceFile(retiredPath, path);
+        return false;
     }
+    ::close(fd);
+    fd = next;
+    length = 0;
+    recordCount = 0;
+    pending = 0;
+    return true;
+}
 
-    cout<<"------------------------------------------------" <<endl;
-    cout<<"Were you provided with enough information about your condition and treatment options? (yes/no): ";
-    cin >> response;
-    feedback.enoughInformationProvided = (response == "yes" || response == "y");
-    if (!feedback.enoughInformationProvided)
+void PatientLog::close()
+{
+    if (fd >= 0)
     {
-        cout<<"Please consult a doctor for more information." <<endl;
+        sync();
+        ::close(fd);
+        fd = -1;
     }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Password hashing.
+// Passwords are stored as scrypt hashes (RFC 7914) with a random salt per patient:
+//   $scrypt$<N>$<r>$<p>$<salt, base64>$<hash, base64>
+// scrypt is built here from SHA-256, PBKDF2-HMAC-SHA256 and the Salsa20/8 core, so the program keeps
+// no dependencies. Its cost is memory bound (128 * r * N bytes per hash), which is what makes guessing
+// expensive on dedicated hardware. Records from before hashing still hold the plaintext password;
+// they are verified as such until --migrate-passwords rewrites them.
+// ---------------------------------------------------------------------------------------------
+
+// Cost of new hashes: 16 MiB and some tens of milliseconds per hash
+const uint64_t SCRYPT_N = 1 << 14;
+const uint32_t SCRYPT_R = 8;
+const uint32_t SCRYPT_P = 1;
+const size_t PASSWORD_SALT_BYTES = 16;
+const size_t PASSWORD_HASH_BYTES = 32;
+const string PASSWORD_HASH_PREFIX = "$scrypt$";
+
+struct Sha256
+{
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t block[64];
+    size_t blockBytes = 0;
+    uint64_t totalBytes = 0;
 
-    cout<<"------------------------------------------------" <<endl;
-    cout<<"Please provide any additional comments or suggestions (press - if none): ";
-    cin.ignore();
-    getline(cin, feedback.additionalComments);
+    void update(const uint8_t* data, size_t size);
+    void finish(uint8_t digest[32]);
 
+private:
+    void compress(const uint8_t* chunk);
+};
+
+inline uint32_t rotateRight(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
 }
 
-int main()
+void Sha256::compress(const uint8_t* chunk)
 {
-    // Store the ID of the logged-in patient
-    string ID;
-    int numYesResponses = 0;
-    vector<Patient> patients = readPatients();
-    bool loggedIn = login(patients,ID);
-    if (!loggedIn)
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+        w[i] = uint32_t(chunk[4 * i]) << 24 | uint32_t(chunk[4 * i + 1]) << 16 | uint32_t(chunk[4 * i + 2]) << 8 | chunk[4 * i + 3];
+    for (int i = 16; i < 64; ++i)
     {
-        cout<<"\nLogin failed. Exiting..." <<endl;
-        return 1; // Exit the program with an error code
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
     }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
 
-    for (const auto& patient : patients)
+void Sha256::update(const uint8_t* data, size_t size)
+{
+    totalBytes += size;
+    while (size > 0)
     {
-        if (patient.patientId == ID) // <-- Here
+        size_t take = min(size, sizeof(block) - blockBytes);
+        memcpy(block + blockBytes, data, take);
+        blockBytes += take;
+        data += take;
+        size -= take;
+        if (blockBytes == sizeof(block))
         {
-            ID = patient.patientId; // This should be corrected to patient.patientId
-            break;
+            compress(block);
+            blockBytes = 0;
         }
     }
+}
 
-    int choice1;
-    bool exitProgram = false; // Flag to control program exit
-    while (!exitProgram) // Loop until the user chooses to exit
+void Sha256::finish(uint8_t digest[32])
+{
+    uint64_t bits = totalBytes * 8;
+    uint8_t padding[72] = {0x80};
+    size_t padBytes = (blockBytes < 56 ? 56 : 120) - blockBytes;
+    for (int i = 0; i < 8; ++i)
+        padding[padBytes + i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    update(padding, padBytes + 8);
+    for (int i = 0; i < 8; ++i)
     {
-        while(true)
-        {
-        welcome_window:
-        {
-        cout<<"\n* - - - - - - - - - - - - - - - - - - - - - - - *"<<endl;
-        cout<<"* ------------------- M E N U ------------------- *" <<endl;
-        cout<<"\n* - - - - - - - - - - - - - - - - - - - - - - - *"<<endl;
-        cout<<"1. Display Personal Information"<<endl;
-        cout<<"2. Identify Disease"<<endl;
-        cout<<"3. Exit"<<endl;
-        cout<<"\n* - - - - - - - - - - - - - - - - - - - - - - - *"<<endl;
+        digest[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+        digest[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+        digest[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+        digest[4 * i + 3] = static_cast<uint8_t>(state[i]);
+    }
+}
 
-        cout<<"\nEnter your choice: ";
-        cin >> choice1;
-        cin.ignore();
+// PBKDF2-HMAC-SHA256 with one iteration, which is all scrypt needs; the HMAC keys are hashed once
+void pbkdf2Sha256(string_view password, const uint8_t* salt, size_t saltSize, uint8_t* out, size_t outSize)
+{
+    uint8_t key[64] = {};
+    if (password.size() > sizeof(key))
+    {
+        Sha256 keyHash;
+        keyHash.update(reinterpret_cast<const uint8_t*>(password.data()), password.size());
+        keyHash.finish(key);
+    }
+    else
+    {
+        memcpy(key, password.data(), password.size());
+    }
+    uint8_t innerPad[64], outerPad[64];
+    for (int i = 0; i < 64; ++i)
+    {
+        innerPad[i] = key[i] ^ 0x36;
+        outerPad[i] = key[i] ^ 0x5c;
+    }
+    Sha256 inner, outer;
+    inner.update(innerPad, sizeof(innerPad));
+    inner.update(salt, saltSize);
+    outer.update(outerPad, sizeof(outerPad));
 
-        switch (choice1)
-        {
-        case 1:
-                // Option to display Personal Information
-                displayPersonalInformation(ID, patients);
-                break;
-        case 2:
-            //disease identification
-            {
-                // List of diseases with their symptoms and treatments
-        vector<Disease> diseases = {
-        {"Fever", {"high temperature", "chills", "sweating", "fatigue"}, {"Paracetamol", "Ibuprofen"}},
-        {"Common Cold", {"runny or stuffy nose", "sore throat", "cough", "congestion", "mild body aches or headache"}, {"Acetaminophen", "Ibuprofen", "Decongestants"}},
-        {"Influenza", {"fever or feeling feverish/chills", "cough", "sore throat", "runny or stuffy nose", "muscle or body aches", "headaches", "fatigue"}, {"Antiviral drugs", "Analgesics", "Antipyretics"}},
-        {"Heart Disease", {"Chest pain", "shortness of breath", "irregular heartbeat"}, {"Enalapril (Renitec - Merck)"," Atenolol (Aten - IPCA)"," Atorvastatin (Lipitor - Pfizer)", "Aspirin (Ecosprin - USV)"}},
-        {"Dengue Fever", {"high fever", "severe headache", "joint and muscle pain"}, {"Paracetamol (Crocin - GlaxoSmithKline)", "intravenous fluids for hydration"}},
-        {"Chikungunya", {"sudden fever", "joint pain", "muscle pain"}, {"Paracetamol (Crocin - GlaxoSmithKline)", "Ibuprofen (Brufen - Abbott) for pain relief"}},
-        {"Malaria", {"fever", "chills", "sweating", "muscle pain"}, {"Chloroquine (Avloclor - AstraZeneca)", "Artemisinin-based combination therapies (ACTs - Various pharmaceuticals)"}},
-        {"Tuberculosis (TB)", {"persistent cough", "chest pain", "weight loss"}, {"Isoniazid (INH - Various)", "Rifampicin (Rimactane - Sanofi)", "Ethambutol (Myambutol - Novartis)", "Pyrazinamide"}},
-        {"Typhoid Fever", {"sustained fever", "headache", "stomach pain"}, {"Ciprofloxacin (Cipro - Bayer)", "Azithromycin (Zithromax - Pfizer)"}},
-        {"Cholera", {"watery diarrhea", "dehydration", "muscle cramps"}, {"Oral rehydration solutions (ORS - Various)", "Azithromycin (Zithromax - Pfizer)"}},
-        {"Jaundice (Hepatitis A)", {"yellowing of skin and eyes", "fatigue", "abdominal pain"}, {"Supportive care", "no specific medication for acute hepatitis A"}},
-        {"Diarrheal Diseases", {"frequent loose stools", "abdominal cramps", "dehydration"}, {"Oral rehydration solutions (ORS - Various)", "Ciprofloxacin (Cipro - Bayer)", "Azithromycin (Zithromax - Pfizer)"}},
-        {"Japanese Encephalitis", {"fever", "headache", "confusion"}, {"Supportive care", "vaccination for prevention"}},
-        {"Chronic Obstructive Pulmonary Disease (COPD)", {"chronic cough", "shortness of breath", "wheezing"}, {"Salbutamol (Asthalin - Cipla)", "Salmeterol (Serevent - GlaxoSmithKline)", "Beclomethasone (Beclate - Cipla)", "Fluticasone (Seroflo - Cipla)"}},
-        {"Diabetes Mellitus", {"increased thirst", "frequent urination", "weight loss"}, {"Metformin (Glycomet - USV)", "Glimepiride (Amaryl - Sanofi)", "Insulin (Various)"}},
-        {"Stroke", {"sudden weakness", "confusion", "difficulty speaking"}, {"Alteplase (Activase - Genentech)", "Aspirin (Ecosprin - USV)", "Warfarin (Coumadin - Bristol-Myers Squibb)"}},
-        {"Respiratory Infections (e.g., Pneumonia)", {"fever", "cough", "difficulty breathing"}, {"Amoxicillin (Moxikind - Mankind)", "Azithromycin (Zithromax - Pfizer)", "Ceftriaxone (Rocephin - Roche)"}},
-        {"Asthma", {"wheezing", "breathlessness", "chest tightness"}, {"Salbutamol (Asthalin - Cipla)", "Salmeterol (Serevent - GlaxoSmithKline)", "Beclomethasone (Beclate - Cipla)"}}
-        };
-                unordered_set<string> viewedDiseases;
-                int numPredicted = 0;
-                int numDetailsDisplayed = 0;
-                int numMedicationsDisplayed = 0;
+    uint8_t digest[32];
+    for (uint32_t blockIndex = 1; outSize > 0; ++blockIndex)
+    {
+        uint8_t counter[4] = {static_cast<uint8_t>(blockIndex >> 24), static_cast<uint8_t>(blockIndex >> 16), static_cast<uint8_t>(blockIndex >> 8), static_cast<uint8_t>(blockIndex)};
+        Sha256 innerBlock = inner;
+        innerBlock.update(counter, sizeof(counter));
+        innerBlock.finish(digest);
+        Sha256 outerBlock = outer;
+        outerBlock.update(digest, sizeof(digest));
+        outerBlock.finish(digest);
+        size_t take = min(outSize, sizeof(digest));
+        memcpy(out, digest, take);
+        out += take;
+        outSize -= take;
+    }
+}
 
-                while (true)
-                {
-                    vector<Disease> matchingDiseases = identifyDiseases(diseases);
-                    numPredicted += matchingDiseases.size();
-
-                    cout<<"\nSuggested diseases based on symptoms:" <<endl;
-                    for (size_t i = 0; i < matchingDiseases.size(); ++i)
-                    {
-                        cout<<i + 1 << ". " << matchingDiseases[i].name <<endl;
-                    }
-
-                    if (matchingDiseases.empty())
-                    {
-                        cout<<"No diseases matched your symptoms. Exiting..." <<endl;
-                        break;
-                    }
-                    char ch;
-                    cout<<"Do you want to perform tests to narrow down the diagnosis? (Y/N): ";
-                    cin >> ch;
-                    cin.ignore();
-                    if (toupper(ch) == 'Y')
-                    {
-                        // List of symptoms for suggesting tests
-                        vector<string> symptoms;
-                        for (const auto& disease : matchingDiseases)
-                        {
-                            for (const auto& symptom : disease.symptoms)
-                                {
-                                    symptoms.push_back(symptom);
-                                }
-                        }
-                        suggestTests(symptoms);
-                    }
-
-                    provideDoctorDetails();
-
-                   // Prompt user to choose a disease from the predicted list
-                    int index;
-                    string choice;
-                    while (true)
-                        {
-                            cout<<"\nEnter the number of the disease to view details (0 to exit, -1 to choose other diseases): ";
-                            getline(cin, choice);
-                            if (choice == "0")
-                            {
-                                double bill = calculateBill(numPredicted, numDetailsDisplayed, numMedicationsDisplayed, numYesResponses);
-
-                                // Display the bill to the user
-                                cout<<"\n********************"<<endl;
-                                cout<<"* THANK YOU FOR USING THE DISEASE IDENTIFYING SYSTEM *" <<endl;
-                                cout<<"********************"<<endl;
-
-                                //bill-
-                                cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
-                                cout<<"\n\nYour bill for using the system is: $" << fixed << setprecision(2) << bill <<endl;
-                                cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
-
-                                cout<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-\n";
-                                cout<<"*       P A Y M E N T   W I N D O W        *\n";
-                                cout<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-\n";
-                                cout<<"Enter C for CASH and O for ONLINE:"<<endl;
-                                cout<<"Choose mode of payment: ";
-                                char paymentMode;
-                                cin >> paymentMode;
-                                cin.ignore();
-
-                                if (paymentMode == 'C' || paymentMode == 'c')
-                                {
-                                    cout<<"\n- - - - - - - - - - - - - - - - - - - - - \n";
-                                    cout<<"|                   C A S H                |\n";
-                                    cout<<"- - - - - - - - - - - - - - - - - - - - - - \n";
-                                    double cash_amt;
-                                    cout<<"Enter cash: ";
-                                    cin>>cash_amt;
-                                    bool flag = calculateChange(bill,cash_amt);
-                                    if (flag==true)
-                                    {
-                                        cout<<"Transaction of Rs." << fixed << setprecision(2) << bill <<" is successful"<<endl;
-                                    }
-                                }
-
-                               else if(paymentMode == 'O' || paymentMode == 'o')
-                                {
-                                    cout<<"\n- - - - - - - - - - - - - - - - - - - - - \n";
-                                    cout<<"|                 O N L I N E              |\n";
-                                    cout<<"- - - - - - - - - - - - - - - - - - - - - \n";
-                                    bool flag2 = processOnlinePayment(bill);
-                                    if(flag2 == true)
-                                    {
-                                        cout<<"Transaction of Rs." << fixed << setprecision(2) << bill <<" is successful"<<endl;
-                                    }
-
-                                }
-
-                                cout<<"\n****************************************************"<<endl;
-                                cout<<"*     E X I T I N G   P A Y M E N T   W I N D O W    *"<<endl;
-                                cout<<"\n****************************************************"<<endl;
-
-                                // Provide feedback option
-                                char feedbackChoice;
-                                cout<<"\nWould you like to provide feedback about your experience? (Y/N): ";
-                                cin >> feedbackChoice;
-                                if (toupper(feedbackChoice) == 'Y')
-                                {
-                                    Feedback patientFeedback;
-                                    provideFeedback(patientFeedback);
-                                    goto welcome_window;
-                                }
-
-                                else goto ex_window;
-
-                                // Write the updated patient data back to the file
-                                writePatients(patients);
-                        }
-
-                        else if (choice == "-1")
-                        {
-                            cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
-                            cout<<"\n     RETURNING TO DISEASE IDENTIFICATION WINDOW    "<<endl;
-                            cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
-                            break; // Allows the user to choose another disease
-                        }
-
-                        try
-                        {
-                            index = stoi(choice) - 1;
-                            if (index < 0 || index >= static_cast<int>(matchingDiseases.size()))
-                            {
-                                throw out_of_range("Invalid index");
-                            }
-
-                            const Disease& selectedDisease = matchingDiseases[index];
-                            string diseaseName = selectedDisease.name;
-
-                            if (viewedDiseases.count(diseaseName) > 0)
-                            {
-                                cout<<"You have already viewed details for " << diseaseName << ". Please choose another disease." <<endl;
-                                continue;
-                            }
-
-                            viewDiseaseDetails(selectedDisease, viewedDiseases);
-                            viewedDiseases.insert(diseaseName);
-                            numDetailsDisplayed++;
-
-                            if (askYesNoQuestion("Do you want to view treatments for " + diseaseName + "?"))
-                            {
-                                cout<<"\nTreatments for " << diseaseName << ":" <<endl;
-                                for (const auto &treatment : selectedDisease.treatments)
-                                {
-                                    cout<<"- " << treatment <<endl;
-                                }
-                                numMedicationsDisplayed++;
-                            }
-                        }
-                catch (const invalid_argument &e)
-                {
-                    cout<<"Invalid input. Please enter a valid number." <<endl;
-                    continue;
-                }
-                catch (const out_of_range &e)
-                {
-                    cout<<"Invalid index. Please enter a valid number within the range." <<endl;
-                    continue;
-                }
-                    }
-                }
-            }
+// Salsa20/8 core over one 64-byte block, in place
+void salsa20_8(uint32_t b[16])
+{
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+    auto rotl = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+    for (int i = 0; i < 8; i += 2)
+    {
+        x[4] ^= rotl(x[0] + x[12], 7);   x[8] ^= rotl(x[4] + x[0], 9);
+        x[12] ^= rotl(x[8] + x[4], 13);  x[0] ^= rotl(x[12] + x[8], 18);
+        x[9] ^= rotl(x[5] + x[1], 7);    x[13] ^= rotl(x[9] + x[5], 9);
+        x[1] ^= rotl(x[13] + x[9], 13);  x[5] ^= rotl(x[1] + x[13], 18);
+        x[14] ^= rotl(x[10] + x[6], 7);  x[2] ^= rotl(x[14] + x[10], 9);
+        x[6] ^= rotl(x[2] + x[14], 13);  x[10] ^= rotl(x[6] + x[2], 18);
+        x[3] ^= rotl(x[15] + x[11], 7);  x[7] ^= rotl(x[3] + x[15], 9);
+        x[11] ^= rotl(x[7] + x[3], 13);  x[15] ^= rotl(x[11] + x[7], 18);
+        x[1] ^= rotl(x[0] + x[3], 7);    x[2] ^= rotl(x[1] + x[0], 9);
+        x[3] ^= rotl(x[2] + x[1], 13);   x[0] ^= rotl(x[3] + x[2], 18);
+        x[6] ^= rotl(x[5] + x[4], 7);    x[7] ^= rotl(x[6] + x[5], 9);
+        x[4] ^= rotl(x[7] + x[6], 13);   x[5] ^= rotl(x[4] + x[7], 18);
+        x[11] ^= rotl(x[10] + x[9], 7);  x[8] ^= rotl(x[11] + x[10], 9);
+        x[9] ^= rotl(x[8] + x[11], 13);  x[10] ^= rotl(x[9] + x[8], 18);
+        x[12] ^= rotl(x[15] + x[14], 7); x[13] ^= rotl(x[12] + x[15], 9);
+        x[14] ^= rotl(x[13] + x[12], 13); x[15] ^= rotl(x[14] + x[13], 18);
+    }
+    for (int i = 0; i < 16; ++i)
+        b[i] += x[i];
+}
 
-            break;
+// scrypt BlockMix: in and out are 2r blocks of 16 words
+void scryptBlockMix(const uint32_t* in, uint32_t* out, uint32_t r)
+{
+    uint32_t x[16];
+    memcpy(x, in + (2 * r - 1) * 16, sizeof(x));
+    for (uint32_t i = 0; i < 2 * r; ++i)
+    {
+        for (int k = 0; k < 16; ++k)
+            x[k] ^= in[i * 16 + k];
+        salsa20_8(x);
+        // even blocks go to the first half of the output, odd blocks to the second
+        memcpy(out + ((i & 1) * r + i / 2) * 16, x, sizeof(x));
+    }
+}
 
-            case 3:
-               ex_window:
-                   {
-                cout<<"\n** E X I T I N G   T H E   P R O G R A M ***\n"<<endl;
-                exitProgram = true; // Set flag to exit the program
-                break; // Exit the program
-                   }
-            default:
-                cout<<"Invalid choice. Please enter a number between 1 and 3." <<endl;
-        }
-            if (exitProgram)
-            {
-                break;
-            }
-        }
-      }
+// scrypt ROMix over one 128r-byte block, in place; v is the N-block scratch table
+void scryptRoMix(uint32_t* block, uint64_t n, uint32_t r, vector<uint32_t>& v)
+{
+    size_t words = 32 * r;
+    v.resize(words * (n + 1));
+    uint32_t* x = block;
+    uint32_t* y = v.data() + words * n; // the last entry is the BlockMix output buffer
+    for (uint64_t i = 0; i < n; ++i)
+    {
+        memcpy(v.data() + words * i, x, words * sizeof(uint32_t));
+        scryptBlockMix(v.data() + words * i, x, r);
+    }
+    for (uint64_t i = 0; i < n; ++i)
+    {
+        uint64_t j = x[words - 16] & (n - 1);
+        const uint32_t* vj = v.data() + words * j;
+        for (size_t k = 0; k < words; ++k)
+            y[k] = x[k] ^ vj[k];
+        scryptBlockMix(y, x, r);
+    }
+}
+
+// scrypt(password, salt, N, r, p) into out; N must be a power of two. Assumes a little-endian host.
+void scrypt(string_view password, const uint8_t* salt, size_t saltSize, uint64_t n, uint32_t r, uint32_t p, uint8_t* out, size_t outSize)
+{
+    // the table is kept per thread, so repeated hashing does not map and fault in fresh memory each time
+    thread_local vector<uint32_t> table;
+    vector<uint32_t> blocks(32 * r * p);
+    pbkdf2Sha256(password, salt, saltSize, reinterpret_cast<uint8_t*>(blocks.data()), blocks.size() * sizeof(uint32_t));
+    for (uint32_t i = 0; i < p; ++i)
+        scryptRoMix(blocks.data() + 32 * r * i, n, r, table);
+    pbkdf2Sha256(password, reinterpret_cast<const uint8_t*>(blocks.data()), blocks.size() * sizeof(uint32_t), out, outSize);
+}
+
+const char BASE64_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Base64 without padding
+string encodeBase64(const uint8_t* data, size_t size)
+{
+    string text;
+    for (size_t i = 0; i < size; i += 3)
+    {
+        uint32_t group = uint32_t(data[i]) << 16 | (i + 1 < size ? uint32_t(data[i + 1]) << 8 : 0) | (i + 2 < size ? data[i + 2] : 0);
+        size_t digits = min<size_t>(4, (size - i) * 8 / 6 + 1);
+        for (size_t d = 0; d < digits; ++d)
+            text += BASE64_DIGITS[(group >> (18 - 6 * d)) & 63];
     }
-    return 0;
+    return text;
+}
+
+bool decodeBase64(string_view text, vector<uint8_t>& data)
+{
+    data.clear();
+    uint32_t group = 0;
+    int bits = 0;
+    for (char c : text)
+    {
+        const char* digit = strchr(BASE64_DIGITS, c);
+        if (c == '\0' || digit == nullptr)
+            return false;
+        group = (group << 6) | static_cast<uint32_t>(digit - BASE64_DIGITS);
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            data.push_back(static_cast<uint8_t>(group >> bits));
+        }
+    }
+    return true;
+}
+
+// Compares in time that depends only on the lengths, never on where the contents differ
+bool constantTimeEquals(string_view a, string_view b)
+{
+    size_t length = max(a.size(), b.size());
+    unsigned char difference = a.size() != b.size();
+    for (size_t i = 0; i < length; ++i)
+        difference |= static_cast<unsigned char>((i < a.size() ? a[i] : 0) ^ (i < b.size() ? b[i] : 0));
+    return difference == 0;
+}
+
+bool isPasswordHash(string_view stored)
+{
+    return stored.compare(0, PASSWORD_HASH_PREFIX.size(), PASSWORD_HASH_PREFIX) == 0;
+}
+
+// Hashes a password with a fresh random salt, in the stored format
+string hashPassword(const string& password)
+{
+    uint8_t salt[PASSWORD_SALT_BYTES];
+    size_t filled = 0;
+    while (filled < sizeof(salt))
+    {
+        ssize_t n = getrandom(salt + filled, sizeof(salt) - filled, 0);
+        if (n < 0 && errno != EINTR)
+            throw runtime_error("no randomness available for a password salt");
+        filled += n > 0 ? static_cast<size_t>(n) : 0;
+    }
+    uint8_t hash[PASSWORD_HASH_BYTES];
+    scrypt(password, salt, sizeof(salt), SCRYPT_N, SCRYPT_R, SCRYPT_P, hash, sizeof(hash));
+    return PASSWORD_HASH_PREFIX + to_string(SCRYPT_N) + "$" + to_string(SCRYPT_R) + "$" + to_string(SCRYPT_P) + "$" +
+           encodeBase64(salt, sizeof(salt)) + "$" + encodeBase64(hash, sizeof(hash));
+}
+
+// Checks a typed password against a stored hash, or against a plaintext password not migrated yet
+bool verifyPassword(const string& password, const string& stored)
+{
+    if (!isPasswordHash(stored))
+        return constantTimeEquals(password, stored);
+
+    vector<string> fields;
+    size_t start = PASSWORD_HASH_PREFIX.size();
+    while (fields.size() < 5)
+    {
+        size_t end = stored.find('$', start);
+        fields.push_back(stored.substr(start, end == string::npos ? string::npos : end - start));
+        if (end == string::npos)
+            break;
+        start = end + 1;
+    }
+    // the cost parameters come from the file, they are bounded so a damaged record cannot exhaust memory
+    if (fields.size() != 5 || !isNumeric(fields[0]) || !isNumeric(fields[1]) || !isNumeric(fields[2]) ||
+        fields[0].size() > 8 || fields[1].size() > 3 || fields[2].size() > 3)
+        return false;
+    uint64_t n = stoull(fields[0]);
+    uint32_t r = static_cast<uint32_t>(stoul(fields[1]));
+    uint32_t p = static_cast<uint32_t>(stoul(fields[2]));
+    vector<uint8_t> salt, expected;
+    if (n < 2 || n > (1 << 20) || (n & (n - 1)) != 0 || r < 1 || r > 32 || p < 1 || p > 16 ||
+        !decodeBase64(fields[3], salt) || !decodeBase64(fields[4], expected) || expected.empty() || expected.size() > 64)
+        return false;
+    vector<uint8_t> actual(expected.size());
+    scrypt(password, salt.data(), salt.size(), n, r, p, actual.data(), actual.size());
+    return constantTimeEquals(string_view(reinterpret_cast<const char*>(actual.data()), actual.size()),
+                              string_view(reinterpret_cast<const char*>(expected.data()), expected.size()));
+}
+
+// Bytes of patients.txt handed to a migration worker at a time, and chunks in flight per worker
+const size_t MIGRATION_CHUNK_BYTES = 4 << 10;
+const size_t MIGRATION_WINDOW_PER_WORKER = 4;
+
+struct MigrationCounts
+{
+    atomic<size_t> hashed{0};
+    atomic<size_t> alreadyHashed{0};
+    atomic<size_t> malformed{0};
+};
+
+// Rewrites the patient lines in [first, last) with hashed passwords; lines that do not parse are kept as they are
+string migratePatientLines(const char* first, const char* last, MigrationCounts& counts)
+{
+    string out;
+    out.reserve((last - first) * 2);
+    Patient p;
+    while (first < last)
+    {
+        const char* newline = static_cast<const char*>(memchr(first, '\n', last - first));
+        const char* end = newline ? newline : last;
+        string_view line(first, end - first);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (!line.empty())
+        {
+            if (!parsePatient(line, p))
+            {
+                counts.malformed++;
+                out.append(line.data(), line.size());
+            }
+            else
+            {
+                if (isPasswordHash(p.password))
+                {
+                    counts.alreadyHashed++;
+                }
+                else
+                {
+                    p.password = hashPassword(p.password);
+                    counts.hashed++;
+                }
+                out += formatPatient(p);
+            }
+            out += '\n';
+        }
+        first = end + 1;
+    }
+    return out;
+}
+
+// Offline migration of a patient snapshot to hashed passwords (--migrate-passwords).
+// The file is mapped and cut into chunks at line boundaries. Workers hash chunks in parallel while this
+// thread writes the finished chunks in file order to a temporary file; workers stay at most a few
+// chunks ahead of the writer, so neither the input nor the output is ever held in memory as a whole.
+// The temporary file then replaces the snapshot. Progress and throughput go to stderr once a second.
+bool migratePasswords(const string& path, unsigned threads)
+{
+    MappedFile file;
+    if (!file.open(path))
+    {
+        cout<<"ERROR! Cannot open " << path <<endl;
+        return false;
+    }
+    string tmpPath = path + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        cout<<"ERROR! Cannot create " << tmpPath <<endl;
+        return false;
+    }
+
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+    vector<const char*> bounds = {begin};
+    while (bounds.back() < end)
+    {
+        const char* cut = min(end, bounds.back() + MIGRATION_CHUNK_BYTES);
+        const char* newline = cut < end ? static_cast<const char*>(memchr(cut, '\n', end - cut)) : nullptr;
+        bounds.push_back(newline ? newline + 1 : end);
+    }
+    size_t chunks = bounds.size() - 1;
+    size_t window = MIGRATION_WINDOW_PER_WORKER * threads;
+
+    MigrationCounts counts;
+    atomic<size_t> nextChunk(0);
+    mutex lock;
+    condition_variable changed;
+    size_t written = 0; // chunks written out so far
+    vector<string> results(window);
+    vector<bool> ready(window, false);
+    vector<thread> workers;
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        workers.emplace_back([&] {
+            for (size_t c = nextChunk++; c < chunks; c = nextChunk++)
+            {
+                {
+                    unique_lock<mutex> guard(lock);
+                    changed.wait(guard, [&] { return c < written + window; });
+                }
+                string out = migratePatientLines(bounds[c], bounds[c + 1], counts);
+                {
+                    lock_guard<mutex> guard(lock);
+                    results[c % window] = move(out);
+                    ready[c % window] = true;
+                }
+                changed.notify_all();
+            }
+        });
+    }
+
+    bool ok = true;
+    auto started = chrono::steady_clock::now();
+    auto lastReport = started;
+    auto report = [&] {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cerr<<"Migrating passwords: " << fixed << setprecision(1) << 100.0 * (bounds[written] - begin) / max<size_t>(1, file.size()) << "% written, "
+            << counts.hashed << " hashed (" << setprecision(0) << counts.hashed / max(seconds, 1e-9) << "/s)" <<endl;
+        lastReport = chrono::steady_clock::now();
+    };
+    for (size_t c = 0; c < chunks; ++c)
+    {
+        string out;
+        {
+            unique_lock<mutex> guard(lock);
+            // a chunk takes a while to hash, so progress is also reported while waiting for one
+            while (!changed.wait_until(guard, lastReport + chrono::seconds(1), [&] { return ready[c % window]; }))
+                report();
+            out = move(results[c % window]);
+            ready[c % window] = false;
+            written = c + 1;
+        }
+        changed.notify_all();
+        size_t done = 0;
+        while (ok && done < out.size())
+        {
+            ssize_t n = write(fd, out.data() + done, out.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            ok = n > 0;
+            done += n > 0 ? static_cast<size_t>(n) : 0;
+        }
+    }
+    for (thread& worker : workers)
+        worker.join();
+    report();
+
+    ok = ok && fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || !replaceFile(tmpPath, path))
+    {
+        remove(tmpPath.c_str());
+        cout<<"ERROR! Cannot write " << tmpPath << ", " << path << " is unchanged" <<endl;
+        return false;
+    }
+    cout<<"Passwords hashed: " << counts.hashed << ", already hashed: " << counts.alreadyHashed << ", lines kept as they were: " << counts.malformed <<endl;
+    return true;
+}
+
+
+// Number of diseases suggested to the user for one identification.
+const size_t MAX_SUGGESTIONS = 5;
+
+// ---------------------------------------------------------------------------------------------
+// Disease knowledge base.
+// The catalogue lives in a compact binary file (diseases.kb) that is mapped into memory once at
+// startup and read in place through string_view accessors, it is never copied into the process.
+// The file is built from the text source (diseases.txt) by --build-kb:
+//   header | diseases | symptoms | symptom refs | treatments | postings | string table | symptom bits
+// Symptoms are lowercased and sorted, so a symptom ID is its rank in alphabetical order and a
+// lookup is a binary search. Each symptom has a posting list of the diseases that have it, and
+// the IDF weights used for ranking are precomputed. Every disease also has a fixed-width bitset of
+// its symptoms, stored word-major: word w of all diseases is one contiguous column, so matching a
+// query is an AND plus popcount streamed down the few columns the query has bits in.
+// Integers are stored in native byte order.
+// ---------------------------------------------------------------------------------------------
+
+const char KB_MAGIC[8] = {'D', 'I', 'S', 'K', 'B', '\0', '\0', '\0'};
+const uint32_t KB_VERSION = 2;
+
+// Location of a string inside the string table
+struct KbString
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct KbHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t diseaseCount;
+    uint32_t symptomCount;
+    uint32_t symptomRefCount;
+    uint32_t treatmentCount;
+    uint32_t postingCount;
+    uint32_t symptomWords;  // 64-bit words in a disease's symptom bitset
+    uint32_t diseaseStride; // diseases per bitset column, padded to a multiple of 8
+    uint64_t stringBytes;
+    uint64_t diseasesOffset;
+    uint64_t symptomsOffset;
+    uint64_t symptomRefsOffset;
+    uint64_t treatmentsOffset;
+    uint64_t postingsOffset;
+    uint64_t stringsOffset;
+    uint64_t bitsOffset;
+};
+
+struct KbDisease
+{
+    KbString name;
+    uint32_t firstSymptomRef;
+    uint32_t symptomRefCount;
+    uint32_t firstTreatment;
+    uint32_t treatmentCount;
+    float mass; // sum of weight * idf over all symptoms of the disease
+};
+
+struct KbSymptom
+{
+    KbString name;
+    uint32_t firstPosting;
+    uint32_t postingCount;
+    float idf; // inverse document frequency, rare symptoms count more
+};
+
+// A symptom of a disease, in the order the catalogue lists them
+struct KbSymptomRef
+{
+    uint32_t symptomId;
+    float weight;
+};
+
+// One entry of a posting list: a disease having the symptom and how strongly the symptom points to it
+struct Posting
+{
+    uint32_t diseaseId;
+    float weight;
+};
+
+// Read-only view over a contiguous array inside the mapping
+template <typename T>
+struct ArrayView
+{
+    const T* first;
+    const T* last;
+
+    const T* begin() const { return first; }
+    const T* end() const { return last; }
+    size_t size() const { return static_cast<size_t>(last - first); }
+    bool empty() const { return first == last; }
+    const T& operator[](size_t i) const { return first[i]; }
+};
+
+// The memory-mapped disease catalogue
+class KnowledgeBase
+{
+public:
+    KnowledgeBase() = default;
+    ~KnowledgeBase() { close(); }
+    KnowledgeBase(const KnowledgeBase&) = delete;
+    KnowledgeBase& operator=(const KnowledgeBase&) = delete;
+
+    // Maps the file and validates its layout, returns false if it is missing or malformed
+    bool open(const string& path);
+    void close();
+
+    size_t diseaseCount() const { return header->diseaseCount; }
+    size_t symptomCount() const { return header->symptomCount; }
+
+    string_view diseaseName(int diseaseId) const { return text(diseases[diseaseId].name); }
+    float diseaseMass(int diseaseId) const { return diseases[diseaseId].mass; }
+    ArrayView<KbSymptomRef> diseaseSymptoms(int diseaseId) const
+    {
+        const KbDisease& d = diseases[diseaseId];
+        return {symptomRefs + d.firstSymptomRef, symptomRefs + d.firstSymptomRef + d.symptomRefCount};
+    }
+    ArrayView<KbString> diseaseTreatments(int diseaseId) const
+    {
+        const KbDisease& d = diseases[diseaseId];
+        return {treatments + d.firstTreatment, treatments + d.firstTreatment + d.treatmentCount};
+    }
+
+    string_view symptomName(int symptomId) const { return text(symptoms[symptomId].name); }
+    float symptomIdf(int symptomId) const { return symptoms[symptomId].idf; }
+    ArrayView<Posting> postings(int symptomId) const
+    {
+        const KbSymptom& s = symptoms[symptomId];
+        return {postingLists + s.firstPosting, postingLists + s.firstPosting + s.postingCount};
+    }
+
+    // Returns the ID of a lowercase symptom, or -1 if no disease has it
+    int findSymptom(string_view lowerSymptom) const;
+
+    // Symptom bitsets: column w holds word w of every disease's bitset, diseaseStride() entries long
+    size_t symptomWords() const { return header->symptomWords; }
+    size_t diseaseStride() const { return header->diseaseStride; }
+    const uint64_t* symptomColumn(size_t word) const { return bits + word * header->diseaseStride; }
+
+    string_view text(const KbString& s) const { return string_view(strings + s.offset, s.length); }
+
+private:
+    bool recordsValid() const;
+
+    MappedFile file;
+    const KbHeader* header = nullptr;
+    const KbDisease* diseases = nullptr;
+    const KbSymptom* symptoms = nullptr;
+    const KbSymptomRef* symptomRefs = nullptr;
+    const KbString* treatments = nullptr;
+    const Posting* postingLists = nullptr;
+    const char* strings = nullptr;
+    const uint64_t* bits = nullptr;
+};
+
+void KnowledgeBase::close()
+{
+    file.close();
+    header = nullptr;
+}
+
+bool KnowledgeBase::open(const string& path)
+{
+    close();
+    if (!file.open(path) || file.size() < sizeof(KbHeader))
+    {
+        close();
+        return false;
+    }
+
+    const char* base = file.data();
+    const size_t mappingSize = file.size();
+    header = reinterpret_cast<const KbHeader*>(base);
+    // every section must lie inside the file, on the 8 byte boundary it was written at; a truncated or
+    // foreign file is rejected
+    auto fits = [&](uint64_t offset, uint64_t count, size_t width) {
+        return offset % 8 == 0 && offset <= mappingSize && count <= (mappingSize - offset) / width;
+    };
+    if (memcmp(header->magic, KB_MAGIC, sizeof(KB_MAGIC)) != 0 || header->version != KB_VERSION ||
+        !fits(header->diseasesOffset, header->diseaseCount, sizeof(KbDisease)) ||
+        !fits(header->symptomsOffset, header->symptomCount, sizeof(KbSymptom)) ||
+        !fits(header->symptomRefsOffset, header->symptomRefCount, sizeof(KbSymptomRef)) ||
+        !fits(header->treatmentsOffset, header->treatmentCount, sizeof(KbString)) ||
+        !fits(header->postingsOffset, header->postingCount, sizeof(Posting)) ||
+        !fits(header->stringsOffset, header->stringBytes, 1) ||
+        header->symptomWords != (header->symptomCount + 63) / 64 || header->diseaseStride % 8 != 0 || header->diseaseStride < header->diseaseCount ||
+        (header->symptomWords > 0 && !fits(header->bitsOffset, uint64_t(header->symptomWords) * header->diseaseStride, sizeof(uint64_t))))
+    {
+        close();
+        return false;
+    }
+    diseases = reinterpret_cast<const KbDisease*>(base + header->diseasesOffset);
+    symptoms = reinterpret_cast<const KbSymptom*>(base + header->symptomsOffset);
+    symptomRefs = reinterpret_cast<const KbSymptomRef*>(base + header->symptomRefsOffset);
+    treatments = reinterpret_cast<const KbString*>(base + header->treatmentsOffset);
+    postingLists = reinterpret_cast<const Posting*>(base + header->postingsOffset);
+    strings = base + header->stringsOffset;
+    bits = reinterpret_cast<const uint64_t*>(base + header->bitsOffset);
+    if (!recordsValid())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool KnowledgeBase::recordsValid() const
+{
+    // every range and reference a record holds must stay inside its section, so nothing read later can
+    // leave the mapping whatever the file contains
+    auto stringFits = [&](const KbString& s) { return s.offset <= header->stringBytes && s.length <= header->stringBytes - s.offset; };
+    auto rangeFits = [](uint32_t first, uint32_t count, uint32_t total) { return first <= total && count <= total - first; };
+    // and every score must be finite, or the ranking loses its order
+    auto weightValid = [](float weight) { return isfinite(weight) && weight > 0; };
+    for (uint32_t d = 0; d < header->diseaseCount; ++d)
+    {
+        const KbDisease& disease = diseases[d];
+        if (!stringFits(disease.name) || !isfinite(disease.mass) || !rangeFits(disease.firstSymptomRef, disease.symptomRefCount, header->symptomRefCount) ||
+            !rangeFits(disease.firstTreatment, disease.treatmentCount, header->treatmentCount))
+            return false;
+    }
+    for (uint32_t id = 0; id < header->symptomCount; ++id)
+    {
+        const KbSymptom& symptom = symptoms[id];
+        if (!stringFits(symptom.name) || !isfinite(symptom.idf) || !rangeFits(symptom.firstPosting, symptom.postingCount, header->postingCount))
+            return false;
+    }
+    for (uint32_t r = 0; r < header->symptomRefCount; ++r)
+    {
+        if (symptomRefs[r].symptomId >= header->symptomCount || !weightValid(symptomRefs[r].weight))
+            return false;
+    }
+    for (uint32_t t = 0; t < header->treatmentCount; ++t)
+    {
+        if (!stringFits(treatments[t]))
+            return false;
+    }
+    for (uint32_t p = 0; p < header->postingCount; ++p)
+    {
+        if (postingLists[p].diseaseId >= header->diseaseCount || !weightValid(postingLists[p].weight))
+            return false;
+    }
+    return true;
+}
+
+int KnowledgeBase::findSymptom(string_view lowerSymptom) const
+{
+    int lo = 0, hi = static_cast<int>(header->symptomCount);
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (symptomName(mid) < lowerSymptom)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < static_cast<int>(header->symptomCount) && symptomName(lo) == lowerSymptom) ? lo : -1;
+}
+
+// Removes leading and trailing blanks
+string trim(const string& str)
+{
+    size_t first = str.find_first_not_of(" \t\r");
+    if (first == string::npos)
+        return "";
+    size_t last = str.find_last_not_of(" \t\r");
+    return str.substr(first, last - first + 1);
+}
+
+// Splits a list at any of the separators and trims every item, empty items are dropped
+vector<string> splitList(const string& list, const char* separators = ";")
+{
+    vector<string> items;
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = list.find_first_of(separators, start);
+        if (end == string::npos)
+            end = list.size();
+        string item = trim(list.substr(start, end - start));
+        if (!item.empty())
+            items.push_back(item);
+        start = end + 1;
+    }
+    return items;
+}
+
+// Largest weight a symptom may be given; keeps every weighted sum finite in the float fields of the kb
+const double MAX_SYMPTOM_WEIGHT = 1e6;
+
+// Reads the text catalogue (see diseases.txt for the format)
+bool readDiseaseSource(const string& path, vector<Disease>& diseases)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        cout<<"ERROR! Cannot open disease source " << path <<endl;
+        return false;
+    }
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line))
+    {
+        lineNumber++;
+        if (trim(line).empty() || line[0] == '#')
+            continue;
+
+        istringstream iss(line);
+        string name, symptoms, treatments;
+        getline(iss, name, '\t');
+        getline(iss, symptoms, '\t');
+        getline(iss, treatments, '\t');
+
+        Disease disease;
+        disease.name = trim(name);
+        for (const string& item : splitList(symptoms))
+        {
+            // "symptom:weight", the weight is optional
+            size_t colon = item.rfind(':');
+            double weight = 1.0;
+            string symptom = item;
+            if (colon != string::npos)
+            {
+                char* end = nullptr;
+                string number = trim(item.substr(colon + 1));
+                weight = strtod(number.c_str(), &end);
+                // strtod also reads "nan" and "inf", and a NaN score would leave the ranking without an order
+                if (number.empty() || *end != '\0' || !isfinite(weight) || weight <= 0 || weight > MAX_SYMPTOM_WEIGHT)
+                {
+                    cout<<"ERROR! " << path << ":" << lineNumber << ": invalid weight in '" << item << "'" <<endl;
+                    return false;
+                }
+                symptom = trim(item.substr(0, colon));
+            }
+            disease.symptoms.push_back(symptom);
+            disease.weights.push_back(weight);
+        }
+        disease.treatments = splitList(treatments);
+
+        if (disease.name.empty() || disease.symptoms.empty())
+        {
+            cout<<"ERROR! " << path << ":" << lineNumber << ": a disease needs a name and at least one symptom" <<endl;
+            return false;
+        }
+        diseases.push_back(disease);
+    }
+    return true;
+}
+
+// Lays the catalogue out in the binary format and writes it to path (through a temporary file that is
+// synced before it is renamed, so a reader never maps a half written knowledge base, even after a crash)
+bool writeKnowledgeBase(const vector<Disease>& diseases, const string& path)
+{
+    // intern symptoms: lowercase, unique, sorted
+    vector<string> symptomNames;
+    for (const Disease& disease : diseases)
+        for (const string& symptom : disease.symptoms)
+            symptomNames.push_back(toLowercase(symptom));
+    sort(symptomNames.begin(), symptomNames.end());
+    symptomNames.erase(unique(symptomNames.begin(), symptomNames.end()), symptomNames.end());
+    auto symptomId = [&](const string& symptom) {
+        return static_cast<uint32_t>(lower_bound(symptomNames.begin(), symptomNames.end(), toLowercase(symptom)) - symptomNames.begin());
+    };
+
+    // identical strings (treatments shared by several diseases) are stored once
+    string stringTable;
+    unordered_map<string, KbString> interned;
+    auto intern = [&](const string& str) {
+        auto it = interned.find(str);
+        if (it != interned.end())
+            return it->second;
+        KbString ref = {static_cast<uint32_t>(stringTable.size()), static_cast<uint32_t>(str.size())};
+        stringTable += str;
+        interned.emplace(str, ref);
+        return ref;
+    };
+
+    vector<KbDisease> kbDiseases;
+    vector<KbSymptomRef> refs;
+    vector<KbString> treatments;
+    vector<vector<Posting>> postings(symptomNames.size());
+    for (size_t d = 0; d < diseases.size(); ++d)
+    {
+        const Disease& disease = diseases[d];
+        KbDisease kd = {intern(disease.name), static_cast<uint32_t>(refs.size()), 0, static_cast<uint32_t>(treatments.size()), 0, 0.0f};
+        for (size_t i = 0; i < disease.symptoms.size(); ++i)
+        {
+            uint32_t id = symptomId(disease.symptoms[i]);
+            float weight = static_cast<float>(i < disease.weights.size() ? disease.weights[i] : 1.0);
+            vector<Posting>& posting = postings[id];
+            // a disease listing the same symptom twice keeps it once, with the larger weight
+            if (!posting.empty() && posting.back().diseaseId == d)
+            {
+                posting.back().weight = max(posting.back().weight, weight);
+                for (uint32_t r = kd.firstSymptomRef; r < refs.size(); ++r)
+                    if (refs[r].symptomId == id)
+                        refs[r].weight = posting.back().weight;
+                continue;
+            }
+            posting.push_back({static_cast<uint32_t>(d), weight});
+            refs.push_back({id, weight});
+        }
+        kd.symptomRefCount = static_cast<uint32_t>(refs.size()) - kd.firstSymptomRef;
+        for (const string& treatment : disease.treatments)
+            treatments.push_back(intern(treatment));
+        kd.treatmentCount = static_cast<uint32_t>(treatments.size()) - kd.firstTreatment;
+        kbDiseases.push_back(kd);
+    }
+
+    // a symptom shared by many diseases says little about any one of them
+    vector<KbSymptom> kbSymptoms;
+    vector<Posting> flatPostings;
+    for (size_t id = 0; id < symptomNames.size(); ++id)
+    {
+        float idf = static_cast<float>(log(1.0 + static_cast<double>(diseases.size()) / postings[id].size()));
+        kbSymptoms.push_back({intern(symptomNames[id]), static_cast<uint32_t>(flatPostings.size()), static_cast<uint32_t>(postings[id].size()), idf});
+        for (const Posting& p : postings[id])
+        {
+            kbDiseases[p.diseaseId].mass += p.weight * idf;
+            flatPostings.push_back(p);
+        }
+    }
+
+    // word-major symptom bitsets, one column of diseaseStride words per 64 symptoms
+    uint32_t symptomWords = static_cast<uint32_t>((kbSymptoms.size() + 63) / 64);
+    uint32_t diseaseStride = static_cast<uint32_t>((kbDiseases.size() + 7) / 8 * 8);
+    vector<uint64_t> bits(size_t(symptomWords) * diseaseStride, 0);
+    for (size_t d = 0; d < kbDiseases.size(); ++d)
+    {
+        for (uint32_t r = kbDiseases[d].firstSymptomRef; r < kbDiseases[d].firstSymptomRef + kbDiseases[d].symptomRefCount; ++r)
+        {
+            uint32_t id = refs[r].symptomId;
+            bits[size_t(id / 64) * diseaseStride + d] |= uint64_t(1) << (id % 64);
+        }
+    }
+
+    KbHeader header = {};
+    memcpy(header.magic, KB_MAGIC, sizeof(KB_MAGIC));
+    header.version = KB_VERSION;
+    header.diseaseCount = static_cast<uint32_t>(kbDiseases.size());
+    header.symptomCount = static_cast<uint32_t>(kbSymptoms.size());
+    header.symptomRefCount = static_cast<uint32_t>(refs.size());
+    header.treatmentCount = static_cast<uint32_t>(treatments.size());
+    header.postingCount = static_cast<uint32_t>(flatPostings.size());
+    header.symptomWords = symptomWords;
+    header.diseaseStride = diseaseStride;
+    header.stringBytes = stringTable.size();
+    // sections follow each other, every one starting on an 8 byte boundary
+    uint64_t offset = sizeof(KbHeader);
+    auto place = [&](uint64_t bytes) {
+        uint64_t at = (offset + 7) & ~uint64_t(7);
+        offset = at + bytes;
+        return at;
+    };
+    header.diseasesOffset = place(kbDiseases.size() * sizeof(KbDisease));
+    header.symptomsOffset = place(kbSymptoms.size() * sizeof(KbSymptom));
+    header.symptomRefsOffset = place(refs.size() * sizeof(KbSymptomRef));
+    header.treatmentsOffset = place(treatments.size() * sizeof(KbString));
+    header.postingsOffset = place(flatPostings.size() * sizeof(Posting));
+    header.stringsOffset = place(stringTable.size());
+    header.bitsOffset = place(bits.size() * sizeof(uint64_t));
+
+    bool written = writeFileDurably(path, [&](ostream& file) {
+        auto writeAt = [&](uint64_t at, const void* data, size_t bytes) {
+            static const char padding[8] = {};
+            file.write(padding, at - static_cast<uint64_t>(file.tellp()));
+            file.write(static_cast<const char*>(data), bytes);
+        };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        writeAt(header.diseasesOffset, kbDiseases.data(), kbDiseases.size() * sizeof(KbDisease));
+        writeAt(header.symptomsOffset, kbSymptoms.data(), kbSymptoms.size() * sizeof(KbSymptom));
+        writeAt(header.symptomRefsOffset, refs.data(), refs.size() * sizeof(KbSymptomRef));
+        writeAt(header.treatmentsOffset, treatments.data(), treatments.size() * sizeof(KbString));
+        writeAt(header.postingsOffset, flatPostings.data(), flatPostings.size() * sizeof(Posting));
+        writeAt(header.stringsOffset, stringTable.data(), stringTable.size());
+        writeAt(header.bitsOffset, bits.data(), bits.size() * sizeof(uint64_t));
+    });
+    if (!written)
+    {
+        cout<<"ERROR! Cannot write " << path <<endl;
+        return false;
+    }
+    return true;
+}
+
+// Converter used by --build-kb: text source -> binary knowledge base
+bool buildKnowledgeBase(const string& sourcePath, const string& kbPath)
+{
+    vector<Disease> diseases;
+    if (!readDiseaseSource(sourcePath, diseases))
+        return false;
+    return writeKnowledgeBase(diseases, kbPath);
+}
+
+// Maps the knowledge base, rebuilding it first when it is missing, not newer than its text source or
+// written in an older format
+bool loadKnowledgeBase(KnowledgeBase& kb, const string& kbPath, const string& sourcePath)
+{
+    struct stat kbStat, sourceStat;
+    bool haveKb = stat(kbPath.c_str(), &kbStat) == 0;
+    bool haveSource = stat(sourcePath.c_str(), &sourceStat) == 0;
+    // nanosecond times; an edit in the same clock tick as the last build also counts as newer
+    auto notNewer = [](const timespec& a, const timespec& b) { return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec); };
+    if (haveSource && (!haveKb || notNewer(kbStat.st_mtim, sourceStat.st_mtim)))
+    {
+        if (!buildKnowledgeBase(sourcePath, kbPath))
+            return false;
+    }
+    if (kb.open(kbPath))
+        return true;
+    return haveSource && buildKnowledgeBase(sourcePath, kbPath) && kb.open(kbPath);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Per-query scratch.
+// The working memory of one diagnosis (match counts, the heap of best matches, the rules fired, the
+// canonical cache key) comes from a monotonic arena kept per thread: allocating is a pointer bump and
+// nothing is freed on its own. A ScratchScope gives back everything taken from the arena while it was
+// open, and the arena keeps its blocks, so once a thread has served a query or two the following
+// queries never touch the heap. Scopes nest; a vector taken in a scope must not grow after the scope
+// has closed, nor be used at all.
+// ---------------------------------------------------------------------------------------------
+
+// Size of the blocks the arena takes from the heap; larger requests get a block of their own
+const size_t SCRATCH_BLOCK_BYTES = 64 * 1024;
+
+class ScratchArena
+{
+public:
+    // Position of the arena, to rewind to
+    struct Mark
+    {
+        size_t block;
+        size_t used;
+    };
+
+    void* allocate(size_t bytes, size_t alignment);
+    Mark mark() const { return {current, used}; }
+    // Gives back everything allocated since m, keeping the blocks
+    void rewind(Mark m)
+    {
+        current = m.block;
+        used = m.used;
+    }
+
+private:
+    struct Block
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    vector<Block> blocks;
+    size_t current = 0; // block being filled
+    size_t used = 0;    // bytes used in it
+};
+
+void* ScratchArena::allocate(size_t bytes, size_t alignment)
+{
+    while (current < blocks.size())
+    {
+        size_t start = (used + alignment - 1) & ~(alignment - 1);
+        if (start + bytes <= blocks[current].size)
+        {
+            used = start + bytes;
+            return blocks[current].data.get() + start;
+        }
+        if (current + 1 == blocks.size())
+            break;
+        current++;
+        used = 0;
+    }
+    // new blocks come from operator new[], aligned for any fundamental type
+    size_t size = max(SCRATCH_BLOCK_BYTES, bytes);
+    blocks.push_back({unique_ptr<char[]>(new char[size]), size});
+    current = blocks.size() - 1;
+    used = bytes;
+    return blocks[current].data.get();
+}
+
+// The arena of the calling thread
+ScratchArena& scratchArena()
+{
+    thread_local ScratchArena arena;
+    return arena;
+}
+
+// Everything taken from the thread's arena while a scope is open is given back when it closes
+class ScratchScope
+{
+public:
+    ScratchScope() : arena(scratchArena()), start(arena.mark()) {}
+    ~ScratchScope() { arena.rewind(start); }
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+
+private:
+    ScratchArena& arena;
+    ScratchArena::Mark start;
+};
+
+// Standard allocator over the thread's arena; deallocation is left to the enclosing ScratchScope
+template <typename T>
+struct ScratchAllocator
+{
+    typedef T value_type;
+
+    ScratchAllocator() = default;
+    template <typename U>
+    ScratchAllocator(const ScratchAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(scratchArena().allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ScratchAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const ScratchAllocator<U>&) const { return false; }
+};
+
+template <typename T>
+using ScratchVector = vector<T, ScratchAllocator<T>>;
+
+// Set of symptoms as a fixed-width bitset, one bit per symptom ID of the knowledge base
+struct SymptomSet
+{
+    vector<uint64_t> words;
+
+    void add(int symptomId) { words[symptomId >> 6] |= uint64_t(1) << (symptomId & 63); }
+    bool has(int symptomId) const { return (words[symptomId >> 6] >> (symptomId & 63)) & 1; }
+    size_t count() const
+    {
+        size_t total = 0;
+        for (uint64_t w : words)
+            total += __builtin_popcountll(w);
+        return total;
+    }
+};
+
+// An empty set sized for the symptoms of kb
+SymptomSet emptySymptomSet(const KnowledgeBase& kb)
+{
+    return SymptomSet{vector<uint64_t>(kb.symptomWords(), 0)};
+}
+
+// Overlap kernels: overlap[d] += popcount(column[d] & query) for d in [0, count), count a multiple of 8.
+// One symptom word of every disease is ANDed with the same word of the query and the set bits counted,
+// eight diseases per instruction with AVX-512, four with AVX2, one at a time otherwise. The best kernel
+// the CPU supports is picked once at startup.
+typedef void (*OverlapKernel)(const uint64_t* column, uint64_t query, uint64_t* overlap, size_t count);
+
+void addOverlapScalar(const uint64_t* column, uint64_t query, uint64_t* overlap, size_t count)
+{
+    for (size_t d = 0; d < count; ++d)
+    {
+        overlap[d] += __builtin_popcountll(column[d] & query);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void addOverlapAvx2(const uint64_t* column, uint64_t query, uint64_t* overlap, size_t count)
+{
+    // popcount of every byte from two nibble lookups, then summed per 64-bit lane
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibble = _mm256_set1_epi8(0x0f);
+    const __m256i q = _mm256_set1_epi64x(static_cast<long long>(query));
+    for (size_t d = 0; d < count; d += 4)
+    {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(column + d)), q);
+        __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, lowNibble));
+        __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), lowNibble));
+        __m256i counts = _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+        __m256i* target = reinterpret_cast<__m256i*>(overlap + d);
+        _mm256_storeu_si256(target, _mm256_add_epi64(_mm256_loadu_si256(target), counts));
+    }
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+void addOverlapAvx512(const uint64_t* column, uint64_t query, uint64_t* overlap, size_t count)
+{
+    const __m512i q = _mm512_set1_epi64(static_cast<long long>(query));
+    for (size_t d = 0; d < count; d += 8)
+    {
+        __m512i counts = _mm512_popcnt_epi64(_mm512_and_si512(_mm512_loadu_si512(column + d), q));
+        _mm512_storeu_si512(overlap + d, _mm512_add_epi64(_mm512_loadu_si512(overlap + d), counts));
+    }
+}
+#endif
+
+OverlapKernel selectOverlapKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+        return addOverlapAvx512;
+    if (__builtin_cpu_supports("avx2"))
+        return addOverlapAvx2;
+#endif
+    return addOverlapScalar;
+}
+
+const OverlapKernel addOverlap = selectOverlapKernel();
+
+// ---------------------------------------------------------------------------------------------
+// Test suggestion rules (tests.txt).
+// Each rule is compiled against the knowledge base into a conjunction of bitmasks over symptom
+// words, so checking it is one AND and compare per word it touches. Rules are indexed by their
+// rarest symptom (the one with the shortest posting list): a query only looks at the rules
+// triggered by symptoms it actually has, so the cost per query stays flat as rules are added.
+// ---------------------------------------------------------------------------------------------
+
+// One required word of a rule's conjunction
+struct RuleMask
+{
+    uint32_t word;
+    uint64_t bits;
+};
+
+struct TestRule
+{
+    vector<RuleMask> masks; // all must match; empty for count rules
+    size_t minSymptoms;     // count rules: fires with at least this many distinct symptoms
+    vector<int> tests;      // indices into TestRules::testNames
+};
+
+struct TestRules
+{
+    vector<TestRule> rules;           // in file order
+    vector<string> testNames;         // each test once
+    vector<vector<int>> triggers;     // symptom ID -> conjunction rules anchored on it
+    vector<int> countRules;           // rules that fire on the number of symptoms
+};
+
+// Reads tests.txt and compiles its rules against kb. Rules naming a symptom no disease has can never
+// fire and are skipped with a warning.
+bool loadTestRules(const KnowledgeBase& kb, const string& path, TestRules& rules)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        cout<<"ERROR! Cannot open test rules " << path <<endl;
+        return false;
+    }
+    rules = TestRules();
+    rules.triggers.resize(kb.symptomCount());
+    unordered_map<string, int> testIds;
+
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line))
+    {
+        lineNumber++;
+        if (trim(line).empty() || line[0] == '#')
+            continue;
+        size_t tab = line.find('\t');
+        string condition = toLowercase(trim(line.substr(0, tab)));
+        vector<string> tests = tab == string::npos ? vector<string>() : splitList(line.substr(tab + 1));
+        if (condition.empty() || tests.empty())
+        {
+            cout<<"ERROR! " << path << ":" << lineNumber << ": a rule needs a condition and at least one test" <<endl;
+            return false;
+        }
+
+        TestRule rule;
+        rule.minSymptoms = 0;
+        int anchor = -1;
+        bool satisfiable = true;
+        if (condition.compare(0, 4, "any ") == 0)
+        {
+            string count = trim(condition.substr(4));
+            if (!isNumeric(count) || count.size() > 6)
+            {
+                cout<<"ERROR! " << path << ":" << lineNumber << ": invalid count in '" << condition << "'" <<endl;
+                return false;
+            }
+            rule.minSymptoms = stoul(count);
+        }
+        else
+        {
+            SymptomSet required = emptySymptomSet(kb);
+            istringstream iss(condition);
+            string symptom;
+            while (getline(iss, symptom, '+'))
+            {
+                int id = kb.findSymptom(trim(symptom));
+                if (id < 0)
+                {
+                    cerr<<"WARNING! " << path << ":" << lineNumber << ": no disease has '" << trim(symptom) << "', rule skipped" <<endl;
+                    satisfiable = false;
+                    break;
+                }
+                required.add(id);
+                if (anchor < 0 || kb.postings(id).size() < kb.postings(anchor).size())
+                    anchor = id;
+            }
+            for (size_t w = 0; w < required.words.size(); ++w)
+            {
+                if (required.words[w] != 0)
+                    rule.masks.push_back({static_cast<uint32_t>(w), required.words[w]});
+            }
+        }
+        if (!satisfiable)
+            continue;
+
+        for (const string& test : tests)
+        {
+            auto inserted = testIds.emplace(test, static_cast<int>(rules.testNames.size()));
+            if (inserted.second)
+                rules.testNames.push_back(test);
+            rule.tests.push_back(inserted.first->second);
+        }
+        int ruleId = static_cast<int>(rules.rules.size());
+        if (anchor >= 0)
+            rules.triggers[anchor].push_back(ruleId);
+        else
+            rules.countRules.push_back(ruleId);
+        rules.rules.push_back(move(rule));
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Fuzzy symptom lookup (synonyms.txt).
+// Free text is resolved against every symptom name of the knowledge base and every synonym of
+// synonyms.txt. A term typed exactly (ignoring case and extra spaces) is one hash lookup. Anything
+// else goes through a trigram inverted index: the posting lists of the query's trigrams are merged
+// to count, per term, how many trigrams it shares with the query, and since one edit changes at most
+// three trigrams only terms sharing enough of them can be within the allowed edit distance. Those few
+// candidates are verified with a Levenshtein computation that stops as soon as the bound is exceeded.
+// ---------------------------------------------------------------------------------------------
+
+struct SymptomTerm
+{
+    string text;
+    int symptomId;
+};
+
+class SymptomMatcher
+{
+public:
+    // Indexes the symptom names of kb and the synonyms listed in synonymsPath
+    bool build(const KnowledgeBase& kb, const string& synonymsPath);
+    // Symptom ID for free text, -1 when no term is close enough
+    int resolve(string_view text) const;
+
+    size_t termCount() const { return terms.size(); }
+
+private:
+    void addTerm(const string& text, int symptomId);
+
+    vector<SymptomTerm> terms;                           // symptom names first, then synonyms
+    unordered_map<string, int> exact;                    // normalised term -> symptom ID
+    unordered_map<uint32_t, vector<uint32_t>> trigrams;  // trigram -> terms containing it, ascending
+};
+
+// Lowercases text and collapses runs of white space into one space, into normalised
+void normaliseSymptom(string_view text, string& normalised)
+{
+    normalised.clear();
+    for (char c : text)
+    {
+        if (isspace(static_cast<unsigned char>(c)))
+        {
+            if (!normalised.empty() && normalised.back() != ' ')
+                normalised += ' ';
+        }
+        else
+        {
+            normalised += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        }
+    }
+    if (!normalised.empty() && normalised.back() == ' ')
+        normalised.pop_back();
+}
+
+string normaliseSymptom(string_view text)
+{
+    string normalised;
+    normalised.reserve(text.size());
+    normaliseSymptom(text, normalised);
+    return normalised;
+}
+
+// Edits tolerated for a term of this length; very short terms must be typed exactly
+int allowedEdits(size_t length)
+{
+    if (length <= 3)
+        return 0;
+    if (length <= 5)
+        return 1;
+    if (length <= 12)
+        return 2;
+    return 3;
+}
+
+// The distinct trigrams of text padded with two spaces on each side, sorted, into grams
+void symptomTrigrams(const string& text, vector<uint32_t>& grams)
+{
+    // a rolling window of three characters, starting and ending in the padding
+    grams.clear();
+    uint32_t window = static_cast<uint32_t>(' ') << 8 | ' ';
+    for (size_t i = 0; i < text.size() + 2; ++i)
+    {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+        window = (window << 8 | c) & 0xFFFFFF;
+        grams.push_back(window);
+    }
+    sort(grams.begin(), grams.end());
+    grams.erase(unique(grams.begin(), grams.end()), grams.end());
+}
+
+vector<uint32_t> symptomTrigrams(const string& text)
+{
+    vector<uint32_t> grams;
+    symptomTrigrams(text, grams);
+    return grams;
+}
+
+// Levenshtein distance between a and b, or bound + 1 as soon as it is known to exceed bound
+int boundedEditDistance(const string& a, const string& b, int bound)
+{
+    int la = static_cast<int>(a.size());
+    int lb = static_cast<int>(b.size());
+    if (abs(la - lb) > bound)
+        return bound + 1;
+    thread_local vector<int> previous;
+    thread_local vector<int> current;
+    previous.resize(lb + 1);
+    current.resize(lb + 1);
+    for (int j = 0; j <= lb; ++j)
+        previous[j] = j;
+    for (int i = 1; i <= la; ++i)
+    {
+        current[0] = i;
+        int rowMin = i;
+        for (int j = 1; j <= lb; ++j)
+        {
+            int substitution = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            current[j] = min(substitution, min(previous[j], current[j - 1]) + 1);
+            rowMin = min(rowMin, current[j]);
+        }
+        if (rowMin > bound)
+            return bound + 1;
+        swap(previous, current);
+    }
+    return min(previous[lb], bound + 1);
+}
+
+void SymptomMatcher::addTerm(const string& text, int symptomId)
+{
+    if (text.empty() || !exact.emplace(text, symptomId).second)
+        return;
+    uint32_t termId = static_cast<uint32_t>(terms.size());
+    terms.push_back({text, symptomId});
+    for (uint32_t gram : symptomTrigrams(text))
+        trigrams[gram].push_back(termId);
+}
+
+bool SymptomMatcher::build(const KnowledgeBase& kb, const string& synonymsPath)
+{
+    ifstream file(synonymsPath);
+    if (!file.is_open())
+    {
+        cout<<"ERROR! Cannot open symptom synonyms " << synonymsPath <<endl;
+        return false;
+    }
+    terms.clear();
+    exact.clear();
+    trigrams.clear();
+    for (int id = 0; id < static_cast<int>(kb.symptomCount()); ++id)
+    {
+        addTerm(normaliseSymptom(kb.symptomName(id)), id);
+    }
+
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line))
+    {
+        lineNumber++;
+        if (trim(line).empty() || line[0] == '#')
+            continue;
+        size_t tab = line.find('\t');
+        if (tab == string::npos)
+        {
+            cout<<"ERROR! " << synonymsPath << ":" << lineNumber << ": expected synonym <TAB> symptom" <<endl;
+            return false;
+        }
+        string symptom = normaliseSymptom(line.substr(tab + 1));
+        int id = kb.findSymptom(symptom);
+        if (id < 0)
+        {
+            cerr<<"WARNING! " << synonymsPath << ":" << lineNumber << ": no disease has '" << symptom << "', synonym skipped" <<endl;
+            continue;
+        }
+        addTerm(normaliseSymptom(line.substr(0, tab)), id);
+    }
+    return true;
+}
+
+int SymptomMatcher::resolve(string_view text) const
+{
+    // the normalised query and its trigrams live in per-thread scratch, like the counts below
+    thread_local string query;
+    normaliseSymptom(text, query);
+    auto found = exact.find(query);
+    if (found != exact.end())
+        return found->second;
+    int bound = allowedEdits(query.size());
+    if (bound == 0)
+        return -1;
+
+    // count the trigrams every term shares with the query, in scratch kept per thread
+    thread_local vector<uint16_t> shared;
+    thread_local vector<uint32_t> touched;
+    thread_local vector<uint32_t> grams;
+    if (shared.size() < terms.size())
+        shared.assign(terms.size(), 0);
+    touched.clear();
+    symptomTrigrams(query, grams);
+    for (uint32_t gram : grams)
+    {
+        auto postings = trigrams.find(gram);
+        if (postings == trigrams.end())
+            continue;
+        for (uint32_t termId : postings->second)
+        {
+            if (shared[termId]++ == 0)
+                touched.push_back(termId);
+        }
+    }
+
+    // q-gram filter: with d edits at least |grams| - 3d trigrams of the query survive, and the lengths
+    // differ by at most d
+    int needed = max(1, static_cast<int>(grams.size()) - 3 * bound);
+    int bestId = -1;
+    int bestDistance = bound + 1;
+    int bestShared = 0;
+    uint32_t bestTerm = 0;
+    for (uint32_t termId : touched)
+    {
+        int common = shared[termId];
+        shared[termId] = 0;
+        const SymptomTerm& term = terms[termId];
+        if (common < needed || abs(static_cast<int>(term.text.size()) - static_cast<int>(query.size())) > bound)
+            continue;
+        int distance = boundedEditDistance(query, term.text, min(bound, bestDistance));
+        if (distance > bound)
+            continue;
+        // closest first, then the most trigrams in common, then names before synonyms
+        if (distance < bestDistance || (distance == bestDistance && (common > bestShared || (common == bestShared && termId < bestTerm))))
+        {
+            bestId = term.symptomId;
+            bestDistance = distance;
+            bestShared = common;
+            bestTerm = termId;
+        }
+    }
+    return bestId;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Symptom autocomplete.
+// The knowledge base keeps symptom names sorted, so the names starting with a prefix are one contiguous
+// range of symptom IDs, found by binary search. Completions are ranked by how many diseases have the
+// symptom (the length of its posting list). A sparse table over those counts answers "most frequent
+// symptom in a range" in O(1); the top N are taken by repeatedly splitting the range around its
+// maximum, so a query costs O(log V + N log N) however large the vocabulary or the range is.
+// ---------------------------------------------------------------------------------------------
+
+// Completions offered for one prefix
+const size_t MAX_COMPLETIONS = 8;
+
+class SymptomCompleter
+{
+public:
+    void build(const KnowledgeBase& kb);
+    // Up to limit symptom IDs starting with prefix (lowercase), most common first
+    vector<int> complete(string_view prefix, size_t limit) const;
+
+private:
+    // The more frequent of two symptoms, the alphabetically first on a tie
+    int moreFrequent(int a, int b) const;
+    // The most frequent symptom in [first, last)
+    int mostFrequent(int first, int last) const;
+
+    const KnowledgeBase* kb = nullptr;
+    vector<uint32_t> frequency;  // symptom ID -> number of diseases with it
+    vector<vector<int>> levels;  // levels[k][i]: most frequent symptom in [i, i + 2^k)
+};
+
+void SymptomCompleter::build(const KnowledgeBase& knowledgeBase)
+{
+    kb = &knowledgeBase;
+    int count = static_cast<int>(kb->symptomCount());
+    frequency.resize(count);
+    levels.assign(1, vector<int>(count));
+    for (int id = 0; id < count; ++id)
+    {
+        frequency[id] = static_cast<uint32_t>(kb->postings(id).size());
+        levels[0][id] = id;
+    }
+    for (int span = 2; span <= count; span *= 2)
+    {
+        const vector<int>& below = levels.back();
+        vector<int> level(count - span + 1);
+        for (int i = 0; i + span <= count; ++i)
+        {
+            level[i] = moreFrequent(below[i], below[i + span / 2]);
+        }
+        levels.push_back(move(level));
+    }
+}
+
+int SymptomCompleter::moreFrequent(int a, int b) const
+{
+    if (frequency[a] != frequency[b])
+        return frequency[a] > frequency[b] ? a : b;
+    return min(a, b);
+}
+
+int SymptomCompleter::mostFrequent(int first, int last) const
+{
+    int k = 31 - __builtin_clz(static_cast<unsigned>(last - first));
+    return moreFrequent(levels[k][first], levels[k][last - (1 << k)]);
+}
+
+vector<int> SymptomCompleter::complete(string_view prefix, size_t limit) const
+{
+    vector<int> completions;
+    int count = static_cast<int>(frequency.size());
+    if (count == 0 || limit == 0)
+        return completions;
+
+    // the names starting with prefix form the range [first, last) of the sorted symptoms
+    int lo = 0;
+    int hi = count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (kb->symptomName(mid) < prefix)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int first = lo;
+    hi = count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (kb->symptomName(mid).substr(0, prefix.size()) == prefix)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int last = lo;
+    if (first >= last)
+        return completions;
+
+    // best-first over subranges, each keyed by its most frequent symptom
+    struct Candidate
+    {
+        int id, first, last;
+    };
+    auto worse = [this](const Candidate& a, const Candidate& b) { return moreFrequent(a.id, b.id) == b.id; };
+    vector<Candidate> heap;
+    heap.push_back({mostFrequent(first, last), first, last});
+    while (!heap.empty() && completions.size() < limit)
+    {
+        pop_heap(heap.begin(), heap.end(), worse);
+        Candidate best = heap.back();
+        heap.pop_back();
+        completions.push_back(best.id);
+        if (best.first < best.id)
+        {
+            heap.push_back({mostFrequent(best.first, best.id), best.first, best.id});
+            push_heap(heap.begin(), heap.end(), worse);
+        }
+        if (best.id + 1 < best.last)
+        {
+            heap.push_back({mostFrequent(best.id + 1, best.last), best.id + 1, best.last});
+            push_heap(heap.begin(), heap.end(), worse);
+        }
+    }
+    return completions;
+}
+
+// A ranked candidate returned by the scoring engine.
+struct DiseaseMatch
+{
+    int diseaseId;
+    double score;        // fraction of the disease's weighted evidence covered by the user's symptoms, 0..1
+    int matchedSymptoms;
+};
+
+// Ordering used by the ranking: higher score first, then more matched symptoms, then catalogue order.
+bool isBetterMatch(const DiseaseMatch& a, const DiseaseMatch& b)
+{
+    if (a.score != b.score)
+        return a.score > b.score;
+    if (a.matchedSymptoms != b.matchedSymptoms)
+        return a.matchedSymptoms > b.matchedSymptoms;
+    return a.diseaseId < b.diseaseId;
+}
+
+// Scores every disease sharing a symptom with the query by IDF-weighted overlap and returns the best k,
+// best first. Shared symptoms are found with the bitset kernels, only the diseases that share at least
+// one are weighed, and only the k best are ever kept, in a bounded heap. All of it is scratch of the
+// caller's ScratchScope.
+ScratchVector<DiseaseMatch> rankDiseases(const KnowledgeBase& kb, const SymptomSet& query, size_t k)
+{
+    // number of shared symptoms of every disease, one pass per query word that has bits set
+    ScratchVector<uint64_t> matched(kb.diseaseStride(), 0);
+    for (size_t w = 0; w < query.words.size(); ++w)
+    {
+        if (query.words[w] != 0)
+        {
+            addOverlap(kb.symptomColumn(w), query.words[w], matched.data(), kb.diseaseStride());
+        }
+    }
+
+    // the heap top is the worst of the k kept so far
+    ScratchVector<DiseaseMatch> best;
+    best.reserve(k + 1);
+    for (int d = 0; d < static_cast<int>(kb.diseaseCount()); ++d)
+    {
+        if (matched[d] == 0)
+            continue;
+        double overlap = 0.0;
+        for (const KbSymptomRef& ref : kb.diseaseSymptoms(d))
+        {
+            if (query.has(ref.symptomId))
+                overlap += ref.weight * kb.symptomIdf(ref.symptomId);
+        }
+        DiseaseMatch candidate = {d, overlap / kb.diseaseMass(d), static_cast<int>(matched[d])};
+        if (best.size() < k)
+        {
+            best.push_back(candidate);
+            push_heap(best.begin(), best.end(), isBetterMatch);
+        }
+        else if (k > 0 && isBetterMatch(candidate, best.front()))
+        {
+            pop_heap(best.begin(), best.end(), isBetterMatch);
+            best.back() = candidate;
+            push_heap(best.begin(), best.end(), isBetterMatch);
+        }
+    }
+    sort_heap(best.begin(), best.end(), isBetterMatch);
+    return best;
+}
+// ---------------------------------------------------------------------------------------------
+// Adaptive interview.
+// Instead of a fixed list of questions, every question is the symptom that best splits the diseases
+// still consistent with the answers: with all candidates equally likely, the entropy gained from a
+// yes/no question is largest when it halves the candidates. A yes keeps the candidates that have the
+// symptom, a no keeps those that do not. The engine keeps, for every symptom, how many candidates
+// have it. An answer updates the counts from the smaller side of the split, subtracting the diseases
+// it rules out or recounting the few that remain, and choosing the next question is one scan over
+// the counts.
+// ---------------------------------------------------------------------------------------------
+
+// The interview stops once this few candidates are left, or after this many questions
+const size_t INTERVIEW_CANDIDATES = MAX_SUGGESTIONS;
+const int INTERVIEW_MAX_QUESTIONS = 10;
+
+class Interview
+{
+public:
+    // Starts over with every disease a candidate
+    void start(const KnowledgeBase& kb);
+    // Releases the per-symptom counts
+    void finish();
+    // The symptom to ask about next, -1 when the candidates are narrow enough or cannot be split
+    int nextQuestion() const;
+    // Narrows the candidates by the answer about symptomId
+    void answer(int symptomId, bool yes);
+
+    size_t candidateCount() const { return remaining; }
+
+private:
+    const KnowledgeBase* kb = nullptr;
+    vector<uint64_t> candidates; // bit d set while disease d is consistent with the answers
+    size_t remaining = 0;
+    vector<uint32_t> counts;     // symptom ID -> number of candidates with it
+    int asked = 0;
+};
+
+void Interview::start(const KnowledgeBase& knowledgeBase)
+{
+    kb = &knowledgeBase;
+    size_t diseases = kb->diseaseCount();
+    candidates.assign((diseases + 63) / 64, ~uint64_t(0));
+    if (diseases % 64 != 0)
+        candidates.back() = (uint64_t(1) << (diseases % 64)) - 1;
+    remaining = diseases;
+    counts.resize(kb->symptomCount());
+    for (size_t s = 0; s < counts.size(); ++s)
+    {
+        counts[s] = static_cast<uint32_t>(kb->postings(static_cast<int>(s)).size());
+    }
+    asked = 0;
+}
+
+void Interview::finish()
+{
+    candidates = vector<uint64_t>();
+    counts = vector<uint32_t>();
+    remaining = 0;
+}
+
+int Interview::nextQuestion() const
+{
+    if (remaining <= INTERVIEW_CANDIDATES || asked >= INTERVIEW_MAX_QUESTIONS)
+        return -1;
+    // the most even split; a symptom all or none of the candidates have (e.g. one already asked) tells nothing
+    int best = -1;
+    uint32_t bestSmaller = 0;
+    for (size_t s = 0; s < counts.size(); ++s)
+    {
+        uint32_t smaller = min<uint32_t>(counts[s], static_cast<uint32_t>(remaining) - counts[s]);
+        if (smaller > bestSmaller)
+        {
+            best = static_cast<int>(s);
+            bestSmaller = smaller;
+        }
+    }
+    return best;
+}
+
+void Interview::answer(int symptomId, bool yes)
+{
+    asked++;
+    const uint64_t* column = kb->symptomColumn(symptomId / 64);
+    uint64_t bit = uint64_t(1) << (symptomId % 64);
+    vector<uint64_t> ruledOut(candidates.size(), 0);
+    size_t ruledOutCount = 0;
+    for (size_t w = 0; w < candidates.size(); ++w)
+    {
+        for (uint64_t word = candidates[w]; word != 0; word &= word - 1)
+        {
+            int d = static_cast<int>(w * 64 + __builtin_ctzll(word));
+            if (((column[d] & bit) != 0) != yes)
+                ruledOut[w] |= uint64_t(1) << (d % 64);
+        }
+        candidates[w] &= ~ruledOut[w];
+        ruledOutCount += __builtin_popcountll(ruledOut[w]);
+    }
+    remaining -= ruledOutCount;
+
+    // update the counts from whichever side is smaller: subtract the ruled out diseases or recount the rest
+    const vector<uint64_t>& changed = ruledOutCount <= remaining ? ruledOut : candidates;
+    if (&changed == &candidates)
+        fill(counts.begin(), counts.end(), 0);
+    uint32_t delta = &changed == &candidates ? 1 : uint32_t(-1);
+    for (size_t w = 0; w < changed.size(); ++w)
+    {
+        for (uint64_t word = changed[w]; word != 0; word &= word - 1)
+        {
+            int d = static_cast<int>(w * 64 + __builtin_ctzll(word));
+            for (const KbSymptomRef& ref : kb->diseaseSymptoms(d))
+            {
+                counts[ref.symptomId] += delta;
+            }
+        }
+    }
+}
+
+
+// Function to display detailed information about a disease
+void viewDiseaseDetails(ostream& out, const KnowledgeBase& kb, int diseaseId, unordered_set<int>& viewedDiseases)
+{
+    out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -" <<endl;
+    out<<"D I S E A S E: " << kb.diseaseName(diseaseId) <<endl;
+    out<<"\nS Y M P T O M S: ";
+    for (const auto& symptom : kb.diseaseSymptoms(diseaseId))
+    {
+        out<<kb.symptomName(symptom.symptomId) << ", ";
+    }
+    out<<endl;
+    out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -" <<endl;
+
+    // Add disease to viewed set
+    viewedDiseases.insert(diseaseId);
+}
+
+// Function to display personal information of the logged-in user
+void displayPersonalInformation(ostream& out, const string& loggedInPatientId, const PatientRepository& patients)
+{
+    // Find the patient with the logged-in ID
+    size_t row = patients.findById(loggedInPatientId);
+
+    if (row != PatientRepository::NO_PATIENT)
+    {
+        Patient patient = patients.patient(row);
+
+        // Display personal information
+        out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+        out<<"\n     P E R S O N A L    I N F O R M A T I O N :    "<<endl;
+        out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+        out<<"Patient ID: " << patient.patientId <<endl;
+        out<<"First Name: " << patient.firstName <<endl;
+        out<<"Last Name: " << patient.lastName <<endl;
+        out<<"Date of Birth: " << patient.dob <<endl;
+        out<<"Age: " << patient.age <<endl;
+        out<<"Gender: " << patient.gender <<endl;
+        out<<"Mobile Number: " << patient.mobileNumber <<endl;
+        out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+
+    }
+    else
+    {
+        out<<"*************"<<endl;
+        out<<"--------* PATIENT NOT FOUND! ---------"<<endl;
+        out<<"*************"<<endl;
+    }
+}
+
+// Symptoms of all the matched diseases, as used for suggesting tests
+template <typename Matches>
+void symptomsOfMatches(const KnowledgeBase& kb, const Matches& matches, SymptomSet& symptoms)
+{
+    symptoms.words.assign(kb.symptomWords(), 0);
+    for (const auto& match : matches)
+    {
+        for (const auto& symptom : kb.diseaseSymptoms(match.diseaseId))
+        {
+            symptoms.add(symptom.symptomId);
+        }
+    }
+}
+
+// Function to pick the tests suggested by a set of symptoms.
+// One pass over the symptoms collects the rules they trigger; the tests of the rules that hold are
+// returned once each, in rule order, as scratch of the caller's ScratchScope.
+ScratchVector<string_view> suggestedTests(const TestRules& rules, const SymptomSet& symptoms)
+{
+    ScratchVector<int> fired;
+    size_t distinctSymptoms = 0;
+    for (size_t w = 0; w < symptoms.words.size(); ++w)
+    {
+        for (uint64_t bits = symptoms.words[w]; bits != 0; bits &= bits - 1)
+        {
+            distinctSymptoms++;
+            int symptomId = static_cast<int>(w * 64 + __builtin_ctzll(bits));
+            for (int ruleId : rules.triggers[symptomId])
+            {
+                const TestRule& rule = rules.rules[ruleId];
+                bool holds = all_of(rule.masks.begin(), rule.masks.end(), [&](const RuleMask& m) {
+                    return (symptoms.words[m.word] & m.bits) == m.bits;
+                });
+                if (holds)
+                    fired.push_back(ruleId);
+            }
+        }
+    }
+    for (int ruleId : rules.countRules)
+    {
+        if (distinctSymptoms >= rules.rules[ruleId].minSymptoms)
+            fired.push_back(ruleId);
+    }
+    sort(fired.begin(), fired.end());
+
+    ScratchVector<string_view> tests;
+    ScratchVector<bool> suggested(rules.testNames.size(), false);
+    for (int ruleId : fired)
+    {
+        for (int test : rules.rules[ruleId].tests)
+        {
+            if (!suggested[test])
+            {
+                suggested[test] = true;
+                tests.push_back(rules.testNames[test]);
+            }
+        }
+    }
+    return tests;
+}
+
+// Function to suggest tests based on symptoms
+template <typename Tests>
+void suggestTests(ostream& out, const Tests& tests)
+{
+    out<<"\nBased on your symptoms, the following tests are suggested:" <<endl;
+    out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+    for (const auto& test : tests)
+    {
+        out<<"- " << test <<endl;
+    }
+    out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+}
+// Amounts of money are kept as whole paise (1/100 rupee), so sums are exact
+typedef int64_t Paise;
+
+//Price per service availed:
+const Paise PREDICTION_FEE = 10000;    // Fee per disease prediction
+const Paise DETAILS_FEE = 5000;        // Fee per disease details viewed
+const Paise MEDICATION_FEE = 3000;     // Fee per medication details viewed
+const Paise YES_RESPONSE_FEE = 4500;   // Fee per "yes" response
+
+// Formats paise as rupees with two decimals, e.g. 93050 -> "930.50"
+string formatMoney(Paise amount)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%s%lld.%02lld", amount < 0 ? "-" : "", static_cast<long long>(llabs(amount) / 100), static_cast<long long>(llabs(amount) % 100));
+    return text;
+}
+
+// Parses an amount in rupees with at most two decimals ("2000", "99.5") into paise
+bool parseMoney(const string& text, Paise& amount)
+{
+    size_t dot = text.find('.');
+    string rupees = text.substr(0, dot);
+    string fraction = dot == string::npos ? "" : text.substr(dot + 1);
+    if ((rupees.empty() && fraction.empty()) || rupees.size() > 12 || fraction.size() > 2 ||
+        (!rupees.empty() && !isNumeric(rupees)) || (!fraction.empty() && !isNumeric(fraction)))
+        return false;
+    fraction.resize(2, '0');
+    amount = (rupees.empty() ? 0 : stoll(rupees)) * 100 + stoll(fraction);
+    return true;
+}
+
+// Bill Calculation
+Paise calculateBill(int numPredicted, int numDetailsDisplayed, int numMedicationsDisplayed, int numYesResponses)
+{
+    //total bill calculation-
+    Paise totalBill = PREDICTION_FEE * numPredicted + DETAILS_FEE * numDetailsDisplayed + MEDICATION_FEE * numMedicationsDisplayed + YES_RESPONSE_FEE * numYesResponses;
+
+    return totalBill;
+}
+
+// Function to provide details of the doctor to consult
+void provideDoctorDetails(ostream& out)
+{
+    out<<"\nFor further diagnosis and consultation, it is recommended to see a general practitioner or an internist." <<endl;
+    out<<"You can visit your nearest health-care center or consult a doctor online." <<endl;
+}
+
+// Function to calculate change for cash payment
+bool calculateChange(ostream& out, Paise billAmount, Paise cashAmount)
+{
+    // Ensure cash amount is greater than or equal to bill amount
+    if (cashAmount < billAmount)
+    {
+        out<<"Error: Insufficient cash provided." << endl;
+        return false;
+    }
+
+    // Calculate change
+    Paise change = cashAmount - billAmount;
+
+    // Output change
+    out<<"Change: Rs. " << formatMoney(change) << endl;
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Billing ledger (billing.log).
+// When a session draws up its bill, its usage (diseases predicted, details viewed, medications viewed,
+// yes responses) is appended to a binary log of fixed-size records, one per kind of usage, each with
+// its own checksum; payments follow as records of their own. Charges are priced when they are billed,
+// so a later change of fees never reprices history. The log is synced in batches like the patient
+// log, and at once for payments. A failed write is cut back off at once, and a record torn by a crash
+// when the ledger is opened. The end-of-day job
+// (--invoices) streams the log once and totals every patient's charges and payments.
+// ---------------------------------------------------------------------------------------------
+
+enum class LedgerEvent : uint8_t
+{
+    Prediction = 1,
+    DetailsViewed,
+    MedicationViewed,
+    YesResponse,
+    Payment
+};
+
+struct LedgerRecord
+{
+    uint32_t checksum;  // crc32 of the rest of the record
+    uint8_t type;       // LedgerEvent
+    uint8_t reserved[3];
+    int64_t time;       // seconds since the epoch
+    uint64_t session;
+    int64_t quantity;
+    Paise amount;       // charge (quantity times the fee) or payment
+    char patientId[24]; // NUL padded
+};
+
+class BillingLedger
+{
+public:
+    BillingLedger() = default;
+    ~BillingLedger() { close(); }
+    BillingLedger(const BillingLedger&) = delete;
+    BillingLedger& operator=(const BillingLedger&) = delete;
+
+    // Cuts off a torn tail and opens the ledger for appending
+    bool open(const string& path);
+    // Appends a record; false if it could not be written, or for a payment, not made durable
+    bool record(uint64_t session, const string& patientId, LedgerEvent type, int64_t quantity, Paise amount);
+    // Forces pending records to disk; false if they could not be synced
+    bool sync();
+    void close();
+
+private:
+    int fd = -1;
+    off_t length = 0;   // bytes of whole records
+    size_t pending = 0; // appended but not yet synced
+    chrono::steady_clock::time_point lastSync;
+};
+
+uint32_t ledgerChecksum(const LedgerRecord& record)
+{
+    return crc32(string_view(reinterpret_cast<const char*>(&record) + sizeof(record.checksum), sizeof(record) - sizeof(record.checksum)));
+}
+
+bool BillingLedger::open(const string& path)
+{
+    close();
+    // recovery: keep every record up to the first one that is torn or fails its checksum
+    size_t validBytes = 0;
+    {
+        MappedFile file;
+        if (file.open(path))
+        {
+            LedgerRecord record;
+            while (file.size() - validBytes >= sizeof(record))
+            {
+                memcpy(&record, file.data() + validBytes, sizeof(record));
+                if (ledgerChecksum(record) != record.checksum)
+                    break;
+                validBytes += sizeof(record);
+            }
+        }
+    }
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, validBytes) != 0)
+    {
+        close();
+        return false;
+    }
+    length = validBytes;
+    lastSync = chrono::steady_clock::now();
+    return true;
+}
+
+bool BillingLedger::record(uint64_t session, const string& patientId, LedgerEvent type, int64_t quantity, Paise amount)
+{
+    if (fd < 0 || quantity == 0)
+        return fd >= 0;
+    LedgerRecord record = {};
+    record.type = static_cast<uint8_t>(type);
+    record.time = time(0);
+    record.session = session;
+    record.quantity = quantity;
+    record.amount = amount;
+    strncpy(record.patientId, patientId.c_str(), sizeof(record.patientId) - 1);
+    record.checksum = ledgerChecksum(record);
+    ssize_t written = write(fd, &record, sizeof(record));
+    // recovery stops at a torn record, so a partial one must not stay in front of later records; nor may
+    // a payment that was reported as failed
+    bool recorded = written == static_cast<ssize_t>(sizeof(record));
+    if (recorded)
+    {
+        pending++;
+        // money received is made durable at once, usage in batches
+        if (type == LedgerEvent::Payment)
+            recorded = sync();
+        else if (pending >= LOG_SYNC_BATCH || chrono::steady_clock::now() - lastSync >= chrono::milliseconds(LOG_SYNC_INTERVAL_MS))
+            sync();
+    }
+    if (!recorded)
+    {
+        if (written > 0 && ftruncate(fd, length) != 0)
+            cerr<<"WARNING! Could not cut a partial record off the billing ledger" <<endl;
+        return false;
+    }
+    length += written;
+    return true;
+}
+
+bool BillingLedger::sync()
+{
+    lastSync = chrono::steady_clock::now();
+    if (fd < 0 || pending == 0)
+        return true;
+    // on failure the records stay pending, so the next sync tries again
+    if (fdatasync(fd) != 0)
+        return false;
+    pending = 0;
+    return true;
+}
+
+void BillingLedger::close()
+{
+    if (fd >= 0)
+    {
+        sync();
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+// One patient's totals for the invoice run
+struct Invoice
+{
+    int64_t quantity[6] = {}; // per LedgerEvent
+    Paise charged[6] = {};
+    Paise paid = 0;
+};
+
+// Prints an invoice per patient for the events of one day (YYYY/MM/DD, local time; empty for all days)
+bool printInvoices(const string& path, const string& day)
+{
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+    if (!day.empty())
+    {
+        tm date = {};
+        bool valid = day.size() == 10 && day[4] == '/' && day[7] == '/' && isNumeric(day.substr(0, 4)) && isNumeric(day.substr(5, 2)) && isNumeric(day.substr(8, 2));
+        if (valid)
+        {
+            date.tm_year = stoi(day.substr(0, 4)) - 1900;
+            date.tm_mon = stoi(day.substr(5, 2)) - 1;
+            date.tm_mday = stoi(day.substr(8, 2));
+            date.tm_isdst = -1;
+            from = mktime(&date);
+            // mktime normalises out-of-range fields, so an invalid date comes back changed
+            valid = date.tm_mon == stoi(day.substr(5, 2)) - 1 && date.tm_mday == stoi(day.substr(8, 2));
+        }
+        if (!valid)
+        {
+            cout<<"ERROR! Invalid date " << day << ", expected YYYY/MM/DD" <<endl;
+            return false;
+        }
+        date.tm_mday++;
+        date.tm_isdst = -1;
+        to = mktime(&date);
+    }
+
+    MappedFile file;
+    if (!file.open(path))
+    {
+        cout<<"ERROR! Cannot open billing ledger " << path <<endl;
+        return false;
+    }
+
+    // one pass over the log, records are read in place
+    map<string, Invoice> invoices;
+    size_t offset = 0;
+    LedgerRecord record;
+    while (file.size() - offset >= sizeof(record))
+    {
+        memcpy(&record, file.data() + offset, sizeof(record));
+        if (ledgerChecksum(record) != record.checksum)
+            break;
+        offset += sizeof(record);
+        if (record.time < from || record.time >= to || record.type < 1 || record.type > 5)
+            continue;
+        Invoice& invoice = invoices[string(record.patientId, strnlen(record.patientId, sizeof(record.patientId)))];
+        if (static_cast<LedgerEvent>(record.type) == LedgerEvent::Payment)
+        {
+            invoice.paid += record.amount;
+        }
+        else
+        {
+            invoice.quantity[record.type] += record.quantity;
+            invoice.charged[record.type] += record.amount;
+        }
+    }
+    if (offset != file.size())
+        cerr<<"WARNING! " << path << ": ignoring " << file.size() - offset << " bytes after the last valid record" <<endl;
+
+    static const char* const items[6] = {"", "Disease predictions", "Disease details viewed", "Medications viewed", "Yes responses", ""};
+    Paise totalCharged = 0;
+    Paise totalPaid = 0;
+    for (const auto& entry : invoices)
+    {
+        const Invoice& invoice = entry.second;
+        Paise charged = 0;
+        cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+        cout<<"INVOICE  Patient ID: " << entry.first << (day.empty() ? "" : "  Date: " + day) <<endl;
+        for (int type = 1; type <= 4; ++type)
+        {
+            if (invoice.quantity[type] == 0)
+                continue;
+            cout<<"  " << left << setw(26) << items[type] << right << setw(6) << invoice.quantity[type] << setw(14) << formatMoney(invoice.charged[type]) <<endl;
+            charged += invoice.charged[type];
+        }
+        cout<<"  " << left << setw(32) << "Total" << right << setw(14) << formatMoney(charged) <<endl;
+        cout<<"  " << left << setw(32) << "Paid" << right << setw(14) << formatMoney(invoice.paid) <<endl;
+        cout<<"  " << left << setw(32) << "Balance due" << right << setw(14) << formatMoney(charged - invoice.paid) <<endl;
+        totalCharged += charged;
+        totalPaid += invoice.paid;
+    }
+    cout<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+    cout<<"Patients: " << invoices.size() << "  Charged: Rs. " << formatMoney(totalCharged) << "  Paid: Rs. " << formatMoney(totalPaid)
+        << "  Due: Rs. " << formatMoney(totalCharged - totalPaid) <<endl;
+    return true;
+}
+
+// to store the feedback given by the user.
+struct Feedback
+{
+    string patientId;
+    int64_t submitted; // seconds since the epoch
+    int overallExperienceRating;
+    string improvementSuggestions;
+    bool concernsAddressed;
+    string concernReason;
+    bool enoughInformationProvided;
+    bool treatmentEffective;
+    bool sideEffectsExperienced;
+    string additionalComments;
+};
+
+// ---------------------------------------------------------------------------------------------
+// Feedback store (feedback.dat).
+// Feedback is appended to a columnar file in blocks. A block holds the records collected since the
+// last flush, column by column:
+//   header | submitted (int64) x n | text ends (u32) x 4n | rating (u8) x n | flags (u8) x n | text heap
+// The four texts of a record (patient ID, suggestions, reason for concerns, comments) live in the
+// heap, so the fixed-width columns a report scans are small and contiguous. Blocks are padded to 8
+// bytes so every column is aligned in place. Blocks are only ever appended, and a failed write is cut
+// back off the file, so a crash can only tear the last one: every block's checksum is verified, and the
+// file is cut off at the first block that is torn or fails it when the store is opened. Records are
+// buffered and written as one block once FEEDBACK_BLOCK_RECORDS are waiting, once the oldest has waited
+// FEEDBACK_FLUSH_INTERVAL_MS, or on sync.
+// ---------------------------------------------------------------------------------------------
+
+const char FEEDBACK_MAGIC[4] = {'F', 'B', 'K', '1'};
+const size_t FEEDBACK_BLOCK_RECORDS = 4096;
+const int FEEDBACK_FLUSH_INTERVAL_MS = 2000;
+const size_t FEEDBACK_TEXTS = 4;
+
+// Flag bits of a feedback record
+const uint8_t FEEDBACK_CONCERNS_ADDRESSED = 1;
+const uint8_t FEEDBACK_ENOUGH_INFORMATION = 2;
+const uint8_t FEEDBACK_TREATMENT_EFFECTIVE = 4;
+const uint8_t FEEDBACK_SIDE_EFFECTS = 8;
+
+struct FeedbackBlockHeader
+{
+    char magic[4];
+    uint32_t count;     // records in the block
+    uint32_t heapBytes; // bytes of text
+    uint32_t checksum;  // crc32 of the rest of the block
+};
+
+// One block read in place from the file
+struct FeedbackBlock
+{
+    uint32_t count;
+    const int64_t* submitted;
+    const uint32_t* textEnds; // end of each text in the heap, FEEDBACK_TEXTS per record
+    const uint8_t* ratings;
+    const uint8_t* flags;
+    const char* heap;
+};
+
+// Bytes of a block after its header, padding included
+size_t feedbackBlockBytes(uint32_t count, uint32_t heapBytes)
+{
+    size_t bytes = size_t(count) * (sizeof(int64_t) + FEEDBACK_TEXTS * sizeof(uint32_t) + 2) + heapBytes;
+    return (bytes + 7) & ~size_t(7);
+}
+
+// Reads the block at offset and advances offset past it; false at the end or at a block that does not fit
+bool readFeedbackBlock(const char* data, size_t size, size_t& offset, FeedbackBlock& block)
+{
+    FeedbackBlockHeader header;
+    if (size - offset < sizeof(header))
+        return false;
+    memcpy(&header, data + offset, sizeof(header));
+    if (memcmp(header.magic, FEEDBACK_MAGIC, sizeof(header.magic)) != 0 || header.count == 0)
+        return false;
+    size_t bytes = feedbackBlockBytes(header.count, header.heapBytes);
+    if (size - offset - sizeof(header) < bytes)
+        return false;
+    const char* columns = data + offset + sizeof(header);
+    block.count = header.count;
+    block.submitted = reinterpret_cast<const int64_t*>(columns);
+    block.textEnds = reinterpret_cast<const uint32_t*>(columns + header.count * sizeof(int64_t));
+    block.ratings = reinterpret_cast<const uint8_t*>(block.textEnds + header.count * FEEDBACK_TEXTS);
+    block.flags = block.ratings + header.count;
+    block.heap = reinterpret_cast<const char*>(block.flags + header.count);
+    offset += sizeof(header) + bytes;
+    return true;
+}
+
+// Bytes of the file covered by whole blocks, up to the first block that fails its checksum
+size_t validFeedbackBytes(const char* data, size_t size)
+{
+    size_t offset = 0;
+    FeedbackBlock block;
+    for (size_t start = 0; readFeedbackBlock(data, size, offset, block); start = offset)
+    {
+        FeedbackBlockHeader header;
+        memcpy(&header, data + start, sizeof(header));
+        if (crc32(string_view(data + start + sizeof(header), offset - start - sizeof(header))) != header.checksum)
+            return start;
+    }
+    return offset;
+}
+
+class FeedbackStore
+{
+public:
+    FeedbackStore() = default;
+    ~FeedbackStore() { close(); }
+    FeedbackStore(const FeedbackStore&) = delete;
+    FeedbackStore& operator=(const FeedbackStore&) = delete;
+
+    // Cuts off a torn tail and opens the file for appending
+    bool open(const string& path);
+    // Buffers one record, writing a block when enough are waiting or the oldest has waited long enough
+    bool append(const Feedback& feedback);
+    // Writes the buffered records as one block and syncs the file; on failure they stay buffered
+    bool sync();
+    void close();
+
+private:
+    int fd = -1;
+    off_t length = 0; // bytes of whole blocks
+    // the pending block, column by column
+    vector<int64_t> submitted;
+    vector<uint32_t> textEnds;
+    vector<uint8_t> ratings;
+    vector<uint8_t> flags;
+    string heap;
+    chrono::steady_clock::time_point firstPending;
+};
+
+bool FeedbackStore::open(const string& path)
+{
+    close();
+    // recovery: keep every block up to the first one that is torn or fails its checksum
+    size_t validBytes = 0;
+    {
+        MappedFile file;
+        if (file.open(path))
+            validBytes = validFeedbackBytes(file.data(), file.size());
+    }
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, validBytes) != 0)
+    {
+        close();
+        return false;
+    }
+    length = validBytes;
+    return true;
+}
+
+bool FeedbackStore::append(const Feedback& feedback)
+{
+    if (ratings.empty())
+        firstPending = chrono::steady_clock::now();
+    submitted.push_back(feedback.submitted);
+    ratings.push_back(static_cast<uint8_t>(feedback.overallExperienceRating));
+    flags.push_back((feedback.concernsAddressed ? FEEDBACK_CONCERNS_ADDRESSED : 0) |
+                    (feedback.enoughInformationProvided ? FEEDBACK_ENOUGH_INFORMATION : 0) |
+                    (feedback.treatmentEffective ? FEEDBACK_TREATMENT_EFFECTIVE : 0) |
+                    (feedback.sideEffectsExperienced ? FEEDBACK_SIDE_EFFECTS : 0));
+    for (const string* text : {&feedback.patientId, &feedback.improvementSuggestions, &feedback.concernReason, &feedback.additionalComments})
+    {
+        heap += *text;
+        textEnds.push_back(static_cast<uint32_t>(heap.size()));
+    }
+    if (ratings.size() >= FEEDBACK_BLOCK_RECORDS || chrono::steady_clock::now() - firstPending >= chrono::milliseconds(FEEDBACK_FLUSH_INTERVAL_MS))
+    {
+        return sync();
+    }
+    return true;
+}
+
+bool FeedbackStore::sync()
+{
+    if (fd < 0 || ratings.empty())
+        return true;
+    FeedbackBlockHeader header;
+    memcpy(header.magic, FEEDBACK_MAGIC, sizeof(header.magic));
+    header.count = static_cast<uint32_t>(ratings.size());
+    header.heapBytes = static_cast<uint32_t>(heap.size());
+
+    string block(sizeof(header), '\0');
+    block.append(reinterpret_cast<const char*>(submitted.data()), submitted.size() * sizeof(int64_t));
+    block.append(reinterpret_cast<const char*>(textEnds.data()), textEnds.size() * sizeof(uint32_t));
+    block.append(reinterpret_cast<const char*>(ratings.data()), ratings.size());
+    block.append(reinterpret_cast<const char*>(flags.data()), flags.size());
+    block += heap;
+    block.resize(sizeof(header) + feedbackBlockBytes(header.count, header.heapBytes), '\0');
+    header.checksum = crc32(string_view(block).substr(sizeof(header)));
+    memcpy(&block[0], &header, sizeof(header));
+
+    // one write per block, a crash leaves at most a torn last block. A failed write or sync is cut back
+    // off, since blocks appended after a torn one would be read as its payload, and the records are
+    // kept for the next attempt
+    if (write(fd, block.data(), block.size()) != static_cast<ssize_t>(block.size()) || fdatasync(fd) != 0)
+    {
+        if (ftruncate(fd, length) != 0)
+            cerr<<"WARNING! Could not cut a partial block off the feedback file" <<endl;
+        return false;
+    }
+    length += block.size();
+    submitted.clear();
+    textEnds.clear();
+    ratings.clear();
+    flags.clear();
+    heap.clear();
+    return true;
+}
+
+void FeedbackStore::close()
+{
+    if (fd >= 0)
+    {
+        sync();
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+// Totals over every feedback record
+struct FeedbackSummary
+{
+    uint64_t records = 0;
+    uint64_t ratings[6] = {}; // records per rating 0-5
+    uint64_t concernsAddressed = 0;
+    uint64_t enoughInformation = 0;
+};
+
+// Aggregates the fixed-width columns of every block. The loops only compare and add over contiguous
+// bytes, so the compiler turns each into SIMD.
+bool summariseFeedback(const string& path, FeedbackSummary& summary)
+{
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+    size_t validBytes = validFeedbackBytes(file.data(), file.size());
+    size_t offset = 0;
+    FeedbackBlock block;
+    while (readFeedbackBlock(file.data(), validBytes, offset, block))
+    {
+        summary.records += block.count;
+        for (uint8_t rating = 0; rating <= 5; ++rating)
+        {
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < block.count; ++i)
+                count += block.ratings[i] == rating;
+            summary.ratings[rating] += count;
+        }
+        uint32_t addressed = 0;
+        uint32_t enough = 0;
+        for (uint32_t i = 0; i < block.count; ++i)
+        {
+            addressed += block.flags[i] & FEEDBACK_CONCERNS_ADDRESSED;
+            enough += (block.flags[i] & FEEDBACK_ENOUGH_INFORMATION) >> 1;
+        }
+        summary.concernsAddressed += addressed;
+        summary.enoughInformation += enough;
+    }
+    if (validBytes != file.size())
+        cerr<<"WARNING! " << path << ": ignoring " << file.size() - validBytes << " bytes after the last valid block" <<endl;
+    return true;
+}
+
+// Prints the rating histogram and the yes rates of a feedback file
+bool printFeedbackReport(const string& path)
+{
+    FeedbackSummary summary;
+    if (!summariseFeedback(path, summary))
+    {
+        cout<<"ERROR! Cannot open feedback file " << path <<endl;
+        return false;
+    }
+    cout<<"Feedback records: " << summary.records <<endl;
+    if (summary.records == 0)
+        return true;
+    double total = static_cast<double>(summary.records);
+    double ratingSum = 0.0;
+    cout<<"\nRating   Count      Share" <<endl;
+    for (int rating = 5; rating >= 0; --rating)
+    {
+        double share = summary.ratings[rating] / total;
+        cout<<setw(6) << rating << setw(8) << summary.ratings[rating] << setw(9) << fixed << setprecision(1) << share * 100 << "%  "
+            << string(static_cast<size_t>(share * 40 + 0.5), '#') <<endl;
+        ratingSum += rating * static_cast<double>(summary.ratings[rating]);
+    }
+    cout<<"\nAverage rating: " << setprecision(2) << ratingSum / total <<endl;
+    cout<<"Concerns addressed: " << setprecision(1) << summary.concernsAddressed / total * 100 << "%" <<endl;
+    cout<<"Enough information provided: " << summary.enoughInformation / total * 100 << "%" <<endl;
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Diagnosis result cache.
+// Most queries repeat a few symptom combinations, so the ranked diseases and the suggested tests are
+// cached per symptom set. The key is the sorted list of symptom IDs, which is the same whatever order
+// the symptoms were entered in. The cache is split into shards by key hash, each with its own lock, so
+// batch workers and server sessions rarely contend. Each shard has a fixed number of slots and evicts
+// with the CLOCK algorithm: a hit sets the slot's referenced bit, and the hand clears referenced bits
+// until it finds a slot that was not used since its last pass. Results are shared, read-only, so a hit
+// copies nothing. Every catalogue snapshot has a cache of its own, so a reload starts with an empty one.
+// ---------------------------------------------------------------------------------------------
+
+// Total cached symptom sets, and the number of shards they are spread over
+const size_t RESULT_CACHE_ENTRIES = 4096;
+const size_t RESULT_CACHE_SHARDS = 16;
+
+struct DiagnosisResult
+{
+    vector<DiseaseMatch> matches;
+    vector<string_view> tests; // point into the TestRules the result was computed with
+};
+
+class ResultCache
+{
+public:
+    explicit ResultCache(size_t capacity = RESULT_CACHE_ENTRIES);
+
+    // The cached result for the sorted symptom IDs, nullptr on a miss
+    shared_ptr<const DiagnosisResult> find(ArrayView<int> key, uint64_t hash);
+    void insert(ArrayView<int> key, uint64_t hash, shared_ptr<const DiagnosisResult> result);
+
+    uint64_t hits() const { return hitCount.load(memory_order_relaxed); }
+    uint64_t misses() const { return missCount.load(memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        uint64_t hash;
+        vector<int> key;
+        shared_ptr<const DiagnosisResult> result;
+        bool referenced;
+    };
+    struct Shard
+    {
+        mutex lock;
+        vector<Slot> slots;
+        unordered_map<uint64_t, uint32_t> index; // hash -> slot
+        size_t hand = 0;
+    };
+
+    Shard& shardFor(uint64_t hash) { return shards[hash % shards.size()]; }
+
+    vector<Shard> shards;
+    size_t slotsPerShard;
+    atomic<uint64_t> hitCount{0};
+    atomic<uint64_t> missCount{0};
+};
+
+ResultCache::ResultCache(size_t capacity) : shards(RESULT_CACHE_SHARDS), slotsPerShard(max<size_t>(1, capacity / RESULT_CACHE_SHARDS))
+{
+}
+
+shared_ptr<const DiagnosisResult> ResultCache::find(ArrayView<int> key, uint64_t hash)
+{
+    Shard& shard = shardFor(hash);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.index.find(hash);
+    if (it == shard.index.end() || !equal(key.begin(), key.end(), shard.slots[it->second].key.begin(), shard.slots[it->second].key.end()))
+    {
+        missCount.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+    Slot& slot = shard.slots[it->second];
+    slot.referenced = true;
+    hitCount.fetch_add(1, memory_order_relaxed);
+    return slot.result;
+}
+
+void ResultCache::insert(ArrayView<int> key, uint64_t hash, shared_ptr<const DiagnosisResult> result)
+{
+    Shard& shard = shardFor(hash);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.index.find(hash);
+    if (it != shard.index.end())
+    {
+        // same set computed twice, or a hash collision: the newer result takes the slot
+        Slot& slot = shard.slots[it->second];
+        slot.key.assign(key.begin(), key.end());
+        slot.result = move(result);
+        return;
+    }
+    uint32_t victim;
+    if (shard.slots.size() < slotsPerShard)
+    {
+        victim = static_cast<uint32_t>(shard.slots.size());
+        shard.slots.push_back(Slot());
+    }
+    else
+    {
+        // CLOCK: give every referenced slot a second chance
+        while (shard.slots[shard.hand].referenced)
+        {
+            shard.slots[shard.hand].referenced = false;
+            shard.hand = (shard.hand + 1) % shard.slots.size();
+        }
+        victim = static_cast<uint32_t>(shard.hand);
+        shard.hand = (shard.hand + 1) % shard.slots.size();
+        shard.index.erase(shard.slots[victim].hash);
+    }
+    shard.slots[victim] = {hash, vector<int>(key.begin(), key.end()), move(result), false};
+    shard.index[hash] = victim;
+}
+
+
+// ---------------------------------------------------------------------------------------------
+// Catalogue snapshots and hot reload.
+// Everything built from the catalogue files (the knowledge base, the test rules, the symptom indexes
+// and the result cache for them) is one immutable Catalog. The CatalogStore publishes the current one
+// RCU-style: readers take a reference without any lock (a pointer load plus a reference count), and a
+// reload builds the replacement off to the side, swaps the pointer and waits only for the readers that
+// were in the middle of taking a reference. Sessions keep the snapshot they started an identification
+// with until they leave it, so nobody sees the catalogue change under them; the old snapshot is freed
+// when its last holder lets go.
+// ---------------------------------------------------------------------------------------------
+
+// The files a catalogue is built from
+const char* const CATALOG_FILES[] = {"diseases.txt", "diseases.kb", "tests.txt", "synonyms.txt"};
+
+// How often the watcher looks at the catalogue files
+const int CATALOG_POLL_MS = 1000;
+
+struct Catalog
+{
+    KnowledgeBase kb;
+    TestRules testRules;
+    SymptomMatcher symptomMatcher;
+    SymptomCompleter symptomCompleter;
+    mutable ResultCache resultCache; // results computed from this catalogue only
+    string fingerprint;              // modification times and sizes of the files it was built from
+};
+
+// Modification time and size of every catalogue file, changes whenever one of them does
+string catalogFingerprint()
+{
+    string fingerprint;
+    for (const char* path : CATALOG_FILES)
+    {
+        struct stat st;
+        if (stat(path, &st) == 0)
+        {
+            fingerprint += to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec) + ":" + to_string(st.st_size);
+        }
+        fingerprint += ';';
+    }
+    return fingerprint;
+}
+
+// Loads the knowledge base (rebuilding diseases.kb if stale), the test rules and the symptom indexes
+bool loadCatalog(Catalog& catalog)
+{
+    if (!loadKnowledgeBase(catalog.kb, "diseases.kb", "diseases.txt"))
+    {
+        cout<<"ERROR! Could not load the disease knowledge base (diseases.kb / diseases.txt)." <<endl;
+        return false;
+    }
+    if (!loadTestRules(catalog.kb, "tests.txt", catalog.testRules))
+    {
+        cout<<"ERROR! Could not load the test suggestion rules (tests.txt)." <<endl;
+        return false;
+    }
+    if (!catalog.symptomMatcher.build(catalog.kb, "synonyms.txt"))
+    {
+        cout<<"ERROR! Could not load the symptom synonyms (synonyms.txt)." <<endl;
+        return false;
+    }
+    catalog.symptomCompleter.build(catalog.kb);
+    // taken after loading, which may itself have rewritten diseases.kb
+    catalog.fingerprint = catalogFingerprint();
+    return true;
+}
+
+volatile sig_atomic_t catalogReloadRequested = 0;
+
+void requestCatalogReload(int)
+{
+    catalogReloadRequested = 1;
+}
+
+class CatalogStore
+{
+public:
+    ~CatalogStore();
+
+    // The catalogue in use. Never blocks; the snapshot stays valid for as long as it is held.
+    shared_ptr<const Catalog> current() const;
+    // Builds a catalogue from the files and publishes it; on error the current one stays
+    bool reload();
+    // Reloads in a background thread whenever a catalogue file changes or SIGHUP arrives
+    void startWatching();
+
+private:
+    void publish(shared_ptr<const Catalog> catalog);
+    void watch();
+
+    // readers taking a reference, counted under the phase they started in
+    struct alignas(64) ReaderCount
+    {
+        atomic<uint64_t> count{0};
+    };
+
+    atomic<shared_ptr<const Catalog>*> published{nullptr};
+    mutable ReaderCount readers[2];
+    atomic<unsigned> phase{0};
+    mutex writerLock; // one reload at a time, never taken by readers
+
+    thread watcher;
+    mutex watchLock;
+    condition_variable watchWake;
+    bool stopping = false;
+};
+
+CatalogStore::~CatalogStore()
+{
+    {
+        lock_guard<mutex> guard(watchLock);
+        stopping = true;
+    }
+    watchWake.notify_all();
+    if (watcher.joinable())
+        watcher.join();
+    delete published.load();
+}
+
+shared_ptr<const Catalog> CatalogStore::current() const
+{
+    unsigned p = phase.load() & 1;
+    readers[p].count.fetch_add(1);
+    shared_ptr<const Catalog> snapshot = *published.load();
+    readers[p].count.fetch_sub(1);
+    return snapshot;
+}
+
+void CatalogStore::publish(shared_ptr<const Catalog> catalog)
+{
+    lock_guard<mutex> guard(writerLock);
+    shared_ptr<const Catalog>* previous = published.exchange(new shared_ptr<const Catalog>(move(catalog)));
+    // Grace period: a reader may still be copying *previous. Flip the phase so new readers count
+    // elsewhere, wait for the old phase to drain, then do the same for the other one, which catches
+    // readers that picked up the phase before an earlier flip.
+    for (int flip = 0; flip < 2; ++flip)
+    {
+        unsigned p = phase.fetch_add(1) & 1;
+        while (readers[p].count.load() != 0)
+            this_thread::yield();
+    }
+    // drops the store's reference, sessions still holding the old catalogue keep it alive
+    delete previous;
+}
+
+bool CatalogStore::reload()
+{
+    auto catalog = make_shared<Catalog>();
+    if (!loadCatalog(*catalog))
+        return false;
+    publish(move(catalog));
+    return true;
+}
+
+void CatalogStore::startWatching()
+{
+    struct sigaction hangup = {};
+    hangup.sa_handler = requestCatalogReload;
+    sigaction(SIGHUP, &hangup, nullptr);
+    watcher = thread(&CatalogStore::watch, this);
+}
+
+void CatalogStore::watch()
+{
+    // a broken edit is reported once, not on every poll until it is fixed
+    string lastAttempt = current()->fingerprint;
+    while (true)
+    {
+        {
+            unique_lock<mutex> guard(watchLock);
+            if (watchWake.wait_for(guard, chrono::milliseconds(CATALOG_POLL_MS), [this] { return stopping; }))
+                return;
+        }
+        string fingerprint = catalogFingerprint();
+        if (!catalogReloadRequested && fingerprint == lastAttempt)
+            continue;
+        catalogReloadRequested = 0;
+        lastAttempt = fingerprint;
+        if (reload())
+        {
+            lastAttempt = current()->fingerprint;
+            cout<<"Disease catalogue reloaded: " << current()->kb.diseaseCount() << " diseases" <<endl;
+        }
+        else
+        {
+            cout<<"ERROR! Catalogue reload failed, keeping the current catalogue." <<endl;
+        }
+    }
+}
+
+// Ranks the diseases for the symptoms and the tests for the best matches, using the catalogue's cache.
+// A cache hit allocates nothing; a miss allocates only the result it caches.
+shared_ptr<const DiagnosisResult> diagnose(const Catalog& catalog, const SymptomSet& symptoms)
+{
+    ScratchScope scope;
+    // canonical key: the symptom IDs in ascending order
+    ScratchVector<int> key;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t w = 0; w < symptoms.words.size(); ++w)
+    {
+        for (uint64_t word = symptoms.words[w]; word != 0; word &= word - 1)
+        {
+            int id = static_cast<int>(w * 64 + __builtin_ctzll(word));
+            key.push_back(id);
+            hash = (hash ^ static_cast<uint64_t>(id)) * 1099511628211ull;
+        }
+    }
+    ArrayView<int> keyView = {key.data(), key.data() + key.size()};
+    countEvent(Counter::Diagnoses);
+    shared_ptr<const DiagnosisResult> cached = catalog.resultCache.find(keyView, hash);
+    if (cached)
+    {
+        countEvent(Counter::CacheHits);
+        countEvent(Counter::Matches, cached->matches.size());
+        return cached;
+    }
+    countEvent(Counter::CacheMisses);
+
+    auto result = make_shared<DiagnosisResult>();
+    {
+        StageTimer timer(Stage::IdentifyDiseases);
+        ScratchVector<DiseaseMatch> matches = rankDiseases(catalog.kb, symptoms, MAX_SUGGESTIONS);
+        result->matches.assign(matches.begin(), matches.end());
+    }
+    {
+        StageTimer timer(Stage::SuggestTests);
+        thread_local SymptomSet matchedSymptoms;
+        symptomsOfMatches(catalog.kb, result->matches, matchedSymptoms);
+        ScratchVector<string_view> tests = suggestedTests(catalog.testRules, matchedSymptoms);
+        result->tests.assign(tests.begin(), tests.end());
+    }
+    countEvent(Counter::Matches, result->matches.size());
+    catalog.resultCache.insert(keyView, hash, result);
+    return result;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Session journal (--journal).
+// Records every input event of every session: the session opening, each line typed, and the session
+// closing, each with the wall-clock time in microseconds and the session ID. Records are
+//   checksum (u32) | type (u8) | reserved (3) | length (u32) | time (i64) | session (u64) | line
+// and are buffered and written in chunks; a torn last record is ignored when the journal is read.
+// Passwords are never written: a line typed at a password prompt is a Secret event whose text is a
+// placeholder of the same length, '*' repeated if the session accepted the password and blanks if it
+// did not. Replay types the fixture's known password (--password) for an accepted one, so recorded
+// logins still succeed and wrong attempts still fail.
+// ---------------------------------------------------------------------------------------------
+
+const size_t JOURNAL_BUFFER_BYTES = 1 << 16;
+
+enum class JournalEvent : uint8_t
+{
+    Open = 1,
+    Line,
+    Close,
+    Secret // a line typed at a password prompt, as a placeholder
+};
+
+// Placeholder characters of a Secret event
+const char SECRET_ACCEPTED = '*';
+const char SECRET_REJECTED = ' ';
+
+// Wall-clock time of a journal event, in microseconds since the epoch
+int64_t journalTime()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+struct JournalHeader
+{
+    uint32_t checksum; // crc32 of the rest of the header and the line
+    uint8_t type;      // JournalEvent
+    uint8_t reserved[3];
+    uint32_t length;   // bytes of the line that follows
+    int64_t time;      // microseconds since the epoch
+    uint64_t session;
+};
+
+class SessionJournal
+{
+public:
+    SessionJournal() = default;
+    ~SessionJournal() { close(); }
+    SessionJournal(const SessionJournal&) = delete;
+    SessionJournal& operator=(const SessionJournal&) = delete;
+
+    // Opens the journal for appending
+    bool open(const string& path);
+    void record(JournalEvent type, uint64_t session, string_view line = string_view(), int64_t time = journalTime());
+    // Writes out the buffered records
+    void flush();
+    void close();
+
+private:
+    int fd = -1;
+    string buffer;
+};
+
+bool SessionJournal::open(const string& path)
+{
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+    buffer.reserve(JOURNAL_BUFFER_BYTES);
+    return fd >= 0;
+}
+
+void SessionJournal::record(JournalEvent type, uint64_t session, string_view line, int64_t time)
+{
+    if (fd < 0)
+        return;
+    JournalHeader header = {};
+    header.type = static_cast<uint8_t>(type);
+    header.length = static_cast<uint32_t>(line.size());
+    header.time = time;
+    header.session = session;
+    size_t start = buffer.size();
+    buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    buffer.append(line.data(), line.size());
+    header.checksum = crc32(string_view(buffer.data() + start + sizeof(header.checksum), buffer.size() - start - sizeof(header.checksum)));
+    memcpy(&buffer[start], &header.checksum, sizeof(header.checksum));
+    if (buffer.size() >= JOURNAL_BUFFER_BYTES)
+        flush();
+}
+
+void SessionJournal::flush()
+{
+    size_t written = 0;
+    while (fd >= 0 && written < buffer.size())
+    {
+        ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            cerr<<"WARNING! The session journal could not be written, recording stopped" <<endl;
+            close();
+            break;
+        }
+        written += static_cast<size_t>(n);
+    }
+    buffer.clear();
+}
+
+void SessionJournal::close()
+{
+    if (fd >= 0)
+    {
+        flush();
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+}
+
+// An event read back from a journal; the line points into the mapped journal
+struct JournalEntry
+{
+    JournalEvent type;
+    int64_t time;
+    uint64_t session;
+    string_view line;
+};
+
+// Appends the events of a mapped journal to entries, stopping at the first torn or damaged record
+void readJournal(const MappedFile& file, const string& path, vector<JournalEntry>& entries)
+{
+    size_t offset = 0;
+    JournalHeader header;
+    while (file.size() - offset >= sizeof(header))
+    {
+        memcpy(&header, file.data() + offset, sizeof(header));
+        if (header.length > file.size() - offset - sizeof(header) || header.type < 1 || header.type > static_cast<uint8_t>(JournalEvent::Secret))
+            break;
+        size_t bytes = sizeof(header) + header.length;
+        if (crc32(string_view(file.data() + offset + sizeof(header.checksum), bytes - sizeof(header.checksum))) != header.checksum)
+            break;
+        entries.push_back({static_cast<JournalEvent>(header.type), header.time, header.session, string_view(file.data() + offset + sizeof(header), header.length)});
+        offset += bytes;
+    }
+    if (offset != file.size())
+        cerr<<"WARNING! " << path << ": ignoring " << file.size() - offset << " bytes after the last valid record" <<endl;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Password workers.
+// Hashing or checking a password is tens of milliseconds of scrypt, and the server runs every session
+// on its one epoll thread, so it hands that work to a small pool: the session submits a job and waits
+// in the Verifying state, a worker runs scrypt, and the finished job is queued and signalled on an
+// eventfd that the epoll loop watches. The loop gives the result back to the session, which then goes
+// on with any lines that arrived meanwhile; no other session waits for scrypt. Logins and registrations
+// are still bounded by scrypt itself, about 20 per second per core at SCRYPT_N = 2^14. The console and
+// replay have no pool and hash on their own thread.
+// ---------------------------------------------------------------------------------------------
+
+struct PasswordJob
+{
+    uint64_t sessionId;
+    bool hash;       // hash password for a new patient, or check it against stored
+    string password;
+    string stored;
+    // the result
+    bool verified = false;
+    string hashed;
+};
+
+class PasswordWorkers
+{
+public:
+    explicit PasswordWorkers(unsigned threads);
+    ~PasswordWorkers();
+    PasswordWorkers(const PasswordWorkers&) = delete;
+    PasswordWorkers& operator=(const PasswordWorkers&) = delete;
+
+    // Readable while finished jobs are waiting; -1 if no eventfd could be made
+    int completionFd() const { return eventFd; }
+    void submit(PasswordJob job);
+    // Takes the finished jobs and clears the readiness of completionFd()
+    vector<PasswordJob> takeFinished();
+
+private:
+    void work();
+
+    mutex lock;
+    condition_variable wake;
+    deque<PasswordJob> queue;
+    vector<PasswordJob> finished;
+    vector<thread> threads;
+    bool stopping = false;
+    int eventFd = -1;
+};
+
+PasswordWorkers::PasswordWorkers(unsigned count)
+{
+    eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    for (unsigned i = 0; i < count; ++i)
+        threads.emplace_back(&PasswordWorkers::work, this);
+}
+
+PasswordWorkers::~PasswordWorkers()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (thread& t : threads)
+        t.join();
+    if (eventFd >= 0)
+        ::close(eventFd);
+}
+
+void PasswordWorkers::submit(PasswordJob job)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        queue.push_back(move(job));
+    }
+    wake.notify_one();
+}
+
+vector<PasswordJob> PasswordWorkers::takeFinished()
+{
+    // the counter is read before the jobs are taken, so a job finished in between is signalled again
+    uint64_t signals;
+    while (read(eventFd, &signals, sizeof(signals)) < 0 && errno == EINTR)
+    {
+    }
+    vector<PasswordJob> jobs;
+    lock_guard<mutex> guard(lock);
+    jobs.swap(finished);
+    return jobs;
+}
+
+void PasswordWorkers::work()
+{
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        wake.wait(guard, [this] { return stopping || !queue.empty(); });
+        if (stopping)
+            return;
+        PasswordJob job = move(queue.front());
+        queue.pop_front();
+        guard.unlock();
+        if (job.hash)
+            job.hashed = hashPassword(job.password);
+        else
+            job.verified = verifyPassword(job.password, job.stored);
+        guard.lock();
+        finished.push_back(move(job));
+        // a write can only fail once the counter is near overflow, and the loop resets it on every read
+        uint64_t one = 1;
+        ssize_t written = write(eventFd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Triage session.
+// One user's walk through login or registration, the menu, disease identification, disease
+// details, the bill and payment, and feedback, written as a state machine: it consumes one line of
+// input at a time and produces the text to show, and never waits for input itself. The console
+// (one session on stdin/stdout) and the server (one session per connection) drive the same machine.
+// ---------------------------------------------------------------------------------------------
+
+// Everything sessions share: the published disease catalogue, one patient store, one feedback store,
+// the billing ledger and the session journal if input is being recorded
+struct TriageServices
+{
+    const CatalogStore& catalogs;
+    PatientRepository& patients;
+    FeedbackStore& feedback;
+    BillingLedger& ledger;
+    SessionJournal* journal = nullptr; // input is recorded when set
+    PasswordWorkers* passwordWorkers = nullptr; // passwords are hashed and checked here when set, off the session's thread
+};
+
+// Hands out session IDs, unique across runs: the start time of the process in the high bits
+uint64_t nextSessionId()
+{
+    static atomic<uint64_t> next(static_cast<uint64_t>(time(0)) << 20);
+    return ++next;
+}
+
+// What the session is waiting for
+enum class SessionState
+{
+    LoginId,
+    LoginPassword,
+    OfferRegistration,
+    RegisterFirstName,
+    RegisterLastName,
+    RegisterAge,
+    RegisterGender,
+    RegisterDob,
+    RegisterMobile,
+    RegisterPassword,
+    RegisterConfirmPassword,
+    Verifying, // a password job is with the PasswordWorkers
+    Menu,
+    Question,
+    SymptomSearch,
+    OfferTests,
+    ChooseDisease,
+    OfferTreatments,
+    PaymentMode,
+    CashAmount,
+    BankName,
+    AccountNumber,
+    Cvv,
+    OfferFeedback,
+    FeedbackRating,
+    FeedbackHasSuggestions,
+    FeedbackSuggestions,
+    FeedbackConcerns,
+    FeedbackConcernReason,
+    FeedbackEnoughInformation,
+    FeedbackComments,
+    Closed
+};
+
+// Allowed bank names for online payment
+const vector<string> BANK_NAMES = {"ICICI Bank", "SBI", "Bank of Baroda", "Axis Bank", "HDFC Bank", "Kotak Mahindra Bank", "IDFC Bank"};
+
+class TriageSession
+{
+public:
+    explicit TriageSession(TriageServices& services) : services(services), sessionId(nextSessionId()) {}
+    ~TriageSession();
+
+    // Shows the welcome banner and the first prompt
+    void start();
+    // Consumes one line of input, without the newline
+    void handleLine(const string& line);
+    // Text produced since the last call
+    string takeOutput();
+
+    bool finished() const { return state == SessionState::Closed; }
+    bool loggedIn() const { return !loggedInId.empty(); }
+    // True while a password job is with the PasswordWorkers; no line may be handled until passwordDone()
+    bool busy() const { return state == SessionState::Verifying; }
+    uint64_t id() const { return sessionId; }
+    // Goes on with the outcome of the session's password job
+    void passwordDone(const PasswordJob& job);
+
+private:
+    // A line typed at a password prompt, kept for the journal until its verdict is known
+    struct SecretLine
+    {
+        SessionState state;
+        size_t length;
+        int64_t received;
+    };
+
+    // Hands the line to the handler of the current state
+    void dispatchLine(const string& line);
+    void onLogin(const string& line);
+    void onRegistration(const string& line);
+    void onMenu(const string& line);
+    void onIdentification(const string& line);
+    void onPayment(const string& line);
+    void onFeedback(const string& line);
+
+    void journalSecret(const SecretLine& secret);
+    void finishLogin(bool verified);
+    void showMenu();
+    void completeRegistration();
+    void finishRegistration(const string& hashedPassword);
+    void startIdentification();
+    void askNextQuestion();
+    void finishInterview();
+    void startSymptomSearch();
+    void promptSymptomSearch();
+    void addSymptom(int symptomId);
+    void identifyDiseases();
+    void promptDiseaseChoice();
+    void showBill();
+    void recordPayment();
+    void finishPayment();
+    void close();
+
+    TriageServices& services;
+    uint64_t sessionId; // tags the session's records in the billing ledger
+    ostringstream out;
+    SessionState state = SessionState::LoginId;
+
+    // login and registration
+    string loginPatientId; // patient whose password is being asked for
+    int attemptsLeft = 0;
+    chrono::steady_clock::time_point loginStarted;
+    SecretLine pendingSecret = {SessionState::Closed, 0, 0};
+    bool secretPending = false;
+    Patient newPatient;
+    string loggedInId;
+
+    // disease identification, counted from entering the identification window until the bill
+    Interview interview;
+    int questionSymptom = -1; // symptom the pending question is about
+    SymptomSet userSymptoms;
+    int numSymptomsReported = 0;
+    vector<int> suggestions; // completions last shown, picked by number
+    shared_ptr<const Catalog> catalog; // snapshot used from entering the identification window until leaving it
+    shared_ptr<const DiagnosisResult> diagnosis;
+    unordered_set<int> viewedDiseases;
+    int selectedDisease = -1;
+    int numPredicted = 0;
+    int numDetailsDisplayed = 0;
+    int numMedicationsDisplayed = 0;
+    int numYesResponses = 0;
+
+    // payment and feedback
+    Paise bill = 0;
+    string bankName;
+    Feedback feedback;
+};
+
+// Returns 1 for a yes answer, 0 for a no answer and -1 for anything else (case-insensitive)
+int parseYesNo(const string& line)
+{
+    string answer = toLowercase(trim(line));
+    if (answer == "yes" || answer == "y")
+        return 1;
+    if (answer == "no" || answer == "n")
+        return 0;
+    return -1;
+}
+
+// True if the first character typed is Y or y, as for the (Y/N) prompts
+bool isYes(const string& line)
+{
+    string answer = trim(line);
+    return !answer.empty() && toupper(answer[0]) == 'Y';
+}
+
+TriageSession::~TriageSession()
+{
+    if (services.journal)
+        services.journal->record(JournalEvent::Close, sessionId);
+}
+
+void TriageSession::start()
+{
+    if (services.journal)
+        services.journal->record(JournalEvent::Open, sessionId);
+    countEvent(Counter::Sessions);
+    out<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*"<<endl;
+    out<<"* WELCOME TO DISEASE IDENTIFYING SYSTEM *" <<endl;
+    out<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*"<<endl;
+    out<<"Enter your user ID or mobile number: ";
+    state = SessionState::LoginId;
+}
+
+string TriageSession::takeOutput()
+{
+    string text = out.str();
+    out.str("");
+    return text;
+}
+
+void TriageSession::handleLine(const string& line)
+{
+    // a password is journaled only once it is known whether it was accepted, and then as a placeholder
+    SessionState before = state;
+    bool secret = before == SessionState::LoginPassword || before == SessionState::RegisterPassword || before == SessionState::RegisterConfirmPassword;
+    int64_t received = services.journal ? journalTime() : 0;
+    if (services.journal && !secret)
+        services.journal->record(JournalEvent::Line, sessionId, line, received);
+    dispatchLine(line);
+    if (services.journal && secret)
+    {
+        if (state == SessionState::Verifying)
+        {
+            // recorded by passwordDone(), once the verdict is in
+            pendingSecret = {before, line.size(), received};
+            secretPending = true;
+        }
+        else
+        {
+            journalSecret(pendingSecret = {before, line.size(), received});
+        }
+    }
+}
+
+void TriageSession::journalSecret(const SecretLine& secret)
+{
+    // rejected: the login prompt again, the end of the session, or the password asked for once more
+    bool rejected = state == secret.state || state == SessionState::Closed ||
+                    (secret.state == SessionState::RegisterConfirmPassword && state == SessionState::RegisterPassword);
+    services.journal->record(JournalEvent::Secret, sessionId, string(secret.length, rejected ? SECRET_REJECTED : SECRET_ACCEPTED), secret.received);
+}
+
+void TriageSession::passwordDone(const PasswordJob& job)
+{
+    if (job.hash)
+        finishRegistration(job.hashed);
+    else
+        finishLogin(job.verified);
+    if (secretPending)
+    {
+        secretPending = false;
+        journalSecret(pendingSecret);
+    }
+}
+
+void TriageSession::dispatchLine(const string& line)
+{
+    switch (state)
+    {
+    case SessionState::LoginId:
+    case SessionState::LoginPassword:
+    case SessionState::OfferRegistration:
+        onLogin(line);
+        break;
+    case SessionState::RegisterFirstName:
+    case SessionState::RegisterLastName:
+    case SessionState::RegisterAge:
+    case SessionState::RegisterGender:
+    case SessionState::RegisterDob:
+    case SessionState::RegisterMobile:
+    case SessionState::RegisterPassword:
+    case SessionState::RegisterConfirmPassword:
+        onRegistration(line);
+        break;
+    case SessionState::Menu:
+        onMenu(line);
+        break;
+    case SessionState::Question:
+    case SessionState::SymptomSearch:
+    case SessionState::OfferTests:
+    case SessionState::ChooseDisease:
+    case SessionState::OfferTreatments:
+        onIdentification(line);
+        break;
+    case SessionState::PaymentMode:
+    case SessionState::CashAmount:
+    case SessionState::BankName:
+    case SessionState::AccountNumber:
+    case SessionState::Cvv:
+        onPayment(line);
+        break;
+    case SessionState::OfferFeedback:
+    case SessionState::FeedbackRating:
+    case SessionState::FeedbackHasSuggestions:
+    case SessionState::FeedbackSuggestions:
+    case SessionState::FeedbackConcerns:
+    case SessionState::FeedbackConcernReason:
+    case SessionState::FeedbackEnoughInformation:
+    case SessionState::FeedbackComments:
+        onFeedback(line);
+        break;
+    case SessionState::Verifying: // the server holds lines back until passwordDone()
+    case SessionState::Closed:
+        break;
+    }
+}
+
+void TriageSession::close()
+{
+    out<<"\n** E X I T I N G   T H E   P R O G R A M ***\n"<<endl;
+    state = SessionState::Closed;
+}
+
+// Login accepts the patient ID or mobile number and allows three password attempts; an unknown user is
+// offered registration.
+void TriageSession::onLogin(const string& line)
+{
+    if (state == SessionState::LoginId)
+    {
+        size_t row = services.patients.findByLogin(trim(line));
+        if (row != PatientRepository::NO_PATIENT)
+        {
+            loginPatientId = services.patients.rows().patientId(row);
+            attemptsLeft = 3; // Number of attempts allowed
+            out<<"Enter your password: ";
+            state = SessionState::LoginPassword;
+        }
+        else
+        {
+            out<<"*****************"<<endl;
+            out<<"* INVALID CREDENTIALS. NO PATIENT FOUND. **"<<endl;
+            out<<"*****************"<<endl;
+            out<<"\nDo you want to register? (Y/N): ";
+            state = SessionState::OfferRegistration;
+        }
+    }
+    else if (state == SessionState::LoginPassword)
+    {
+        // a login attempt is timed from the lookup of the patient to the verdict on the password
+        loginStarted = chrono::steady_clock::now();
+        size_t row = services.patients.findById(loginPatientId);
+        bool found = row != PatientRepository::NO_PATIENT;
+        if (found && services.passwordWorkers)
+        {
+            services.passwordWorkers->submit({sessionId, false, line, string(services.patients.rows().password(row)), false, string()});
+            state = SessionState::Verifying;
+            return;
+        }
+        finishLogin(found && verifyPassword(line, string(services.patients.rows().password(row))));
+    }
+    else if (state == SessionState::OfferRegistration)
+    {
+        if (isYes(line))
+        {
+            newPatient = Patient();
+            out<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*"<<endl;
+            out<<"\n** PATIENT REGISTRATION WINDOW **" <<endl;
+            out<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*"<<endl;
+            out<<"Enter your first name: ";
+            state = SessionState::RegisterFirstName;
+        }
+        else
+        {
+            out<<"\nLogin failed. Exiting..." <<endl;
+            state = SessionState::Closed;
+        }
+    }
+}
+
+// Registration asks for every field in turn and asks again until the value is valid
+void TriageSession::onRegistration(const string& line)
+{
+    string value = trim(line);
+    switch (state)
+    {
+    case SessionState::RegisterFirstName:
+        if (!validateName(value))
+        {
+            out<<"ERROR!. Please re-enter your first name: ";
+            return;
+        }
+        newPatient.firstName = value;
+        out<<"Enter your last name: ";
+        state = SessionState::RegisterLastName;
+        break;
+    case SessionState::RegisterLastName:
+        if (!validateName(value))
+        {
+            out<<"ERROR!. Please re-enter your last name: ";
+            return;
+        }
+        newPatient.lastName = value;
+        out<<"Enter your age: ";
+        state = SessionState::RegisterAge;
+        break;
+    case SessionState::RegisterAge:
+        if (!isNumeric(value) || value.size() > 3 || stoi(value) <= 0)
+        {
+            out<<"ERROR!. Please re-enter your age: ";
+            return;
+        }
+        newPatient.age = stoi(value);
+        out<<"Enter your gender (M/F): ";
+        state = SessionState::RegisterGender;
+        break;
+    case SessionState::RegisterGender:
+        newPatient.gender = value.empty() ? ' ' : static_cast<char>(toupper(value[0]));
+        if (value.size() != 1 || (newPatient.gender != 'M' && newPatient.gender != 'F'))
+        {
+            out<<"ERROR!. Please re-enter your gender (M/F): ";
+            return;
+        }
+        out<<"Enter your date of birth (DD/MM/YYYY): ";
+        state = SessionState::RegisterDob;
+        break;
+    case SessionState::RegisterDob:
+        if (!isValidDate(value))
+        {
+            out<<"ERROR!. Please re-enter your date of birth (DD/MM/YYYY): ";
+            return;
+        }
+        newPatient.dob = value;
+        out<<"Enter your mobile number: ";
+        state = SessionState::RegisterMobile;
+        break;
+    case SessionState::RegisterMobile:
+        if (!validateMobile(value))
+        {
+            out<<"ERROR!. Please re-enter your mobile number: ";
+            return;
+        }
+        newPatient.mobileNumber = value;
+        out<<"Enter a password: ";
+        state = SessionState::RegisterPassword;
+        break;
+    case SessionState::RegisterPassword:
+        // the password is one word, it is stored in a tab separated file
+        if (value.empty() || value.find_first_of(" \t") != string::npos)
+        {
+            out<<"ERROR!. Please enter a password without spaces: ";
+            return;
+        }
+        newPatient.password = value;
+        out<<"Confirm your password: ";
+        state = SessionState::RegisterConfirmPassword;
+        break;
+    case SessionState::RegisterConfirmPassword:
+        if (value != newPatient.password)
+        {
+            out<<"*******"<<endl;
+            out<<"* PASSWORDS DO NOT MATCH . RE - ENTER! **"<<endl;
+            out<<"*******"<<endl;
+            out<<"\nRe-enter your password: ";
+            state = SessionState::RegisterPassword;
+            return;
+        }
+        completeRegistration();
+        break;
+    default:
+        break;
+    }
+}
+
+// Logs the patient in, or takes one of their attempts
+void TriageSession::finishLogin(bool verified)
+{
+    recordStageLatency(Stage::Login, loginStarted);
+    if (verified)
+    {
+        size_t row = services.patients.findById(loginPatientId);
+        const PatientTable& patients = services.patients.rows();
+        out<<"\n*********************************************************************\n";
+        out<<"* LOGIN SUCCESSFUL!! WELCOME, " << patients.firstName(row) << " " << patients.lastName(row) << " *" <<endl;
+        out<<"***********************************************************************\n\n";
+        loggedInId = loginPatientId;
+        countEvent(Counter::Logins);
+        showMenu();
+        return;
+    }
+    countEvent(Counter::FailedLogins);
+    attemptsLeft--;
+    if (attemptsLeft > 0)
+    {
+        out<<"***************************************************"<<endl;
+        out<<"* INCORRECT PASSWORD. " << attemptsLeft << " ATTEMPTS LEFT *" <<endl;
+        out<<"***************************************************"<<endl;
+        out<<"Enter your password: ";
+        state = SessionState::LoginPassword;
+    }
+    else
+    {
+        out<<"************************************************"<<endl;
+        out<<"*  INCORRECT PASSWORD. NO MORE ATTEMPTS LEFT.  *"<<endl;
+        out<<"************************************************"<<endl;
+        out<<"\nLogin failed. Exiting..." <<endl;
+        state = SessionState::Closed;
+    }
+}
+
+void TriageSession::completeRegistration()
+{
+    if (services.passwordWorkers)
+    {
+        services.passwordWorkers->submit({sessionId, true, newPatient.password, string(), false, string()});
+        state = SessionState::Verifying;
+        return;
+    }
+    finishRegistration(hashPassword(newPatient.password));
+}
+
+void TriageSession::finishRegistration(const string& hashedPassword)
+{
+    newPatient.patientId = generatePatientId(services.patients);
+    newPatient.password = hashedPassword;
+    time_t now = time(0);
+    char buf[100];
+    strftime(buf, sizeof(buf), "%Y/%m/%d", localtime(&now));
+    newPatient.registrationDate = buf;
+
+    if (services.patients.add(newPatient) == PatientRepository::NO_PATIENT)
+    {
+        out<<"ERROR! Your registration could not be saved. Please try again later." <<endl;
+        state = SessionState::Closed;
+        return;
+    }
+    loggedInId = newPatient.patientId;
+    countEvent(Counter::Registrations);
+
+    out<<"*******************************************************************************"<<endl;
+    out<<"\n** R E G I S T R A T I O N   S U C C E S S F U L ! !   W E L C O M E, " << newPatient.firstName << " **\n" <<endl;
+    out<<"*******************************************************************************"<<endl;
+    out<<"Your patient ID is " << newPatient.patientId <<endl;
+    showMenu();
+}
+
+void TriageSession::showMenu()
+{
+    // outside the identification window the session holds no catalogue snapshot
+    diagnosis.reset();
+    catalog.reset();
+    out<<"\n* - - - - - - - - - - - - - - - - - - - - - - - *"<<endl;
+    out<<"* ------------------- M E N U ------------------- *" <<endl;
+    out<<"\n* - - - - - - - - - - - - - - - - - - - - - - - *"<<endl;
+    out<<"1. Display Personal Information"<<endl;
+    out<<"2. Identify Disease"<<endl;
+    out<<"3. Exit"<<endl;
+    out<<"\n* - - - - - - - - - - - - - - - - - - - - - - - *"<<endl;
+    out<<"\nEnter your choice: ";
+    state = SessionState::Menu;
+}
+
+void TriageSession::onMenu(const string& line)
+{
+    string choice = trim(line);
+    if (choice == "1")
+    {
+        // Option to display Personal Information
+        displayPersonalInformation(out, loggedInId, services.patients);
+        showMenu();
+    }
+    else if (choice == "2")
+    {
+        // a fresh visit to the identification window starts a fresh bill
+        viewedDiseases.clear();
+        numPredicted = 0;
+        numDetailsDisplayed = 0;
+        numMedicationsDisplayed = 0;
+        numYesResponses = 0;
+        startIdentification();
+    }
+    else if (choice == "3")
+    {
+        close();
+    }
+    else
+    {
+        out<<"Invalid choice. Please enter a number between 1 and 3." <<endl;
+        showMenu();
+    }
+}
+
+void TriageSession::startIdentification()
+{
+    catalog = services.catalogs.current();
+    userSymptoms = emptySymptomSet(catalog->kb);
+    numSymptomsReported = 0;
+    diagnosis.reset();
+    interview.start(catalog->kb);
+
+    out<<"************************************"<<endl;
+    out<<"** DISEASE IDENTIFICATION WINDOW ***"<<endl;
+    out<<"************************************"<<endl;
+    out<<"\nLet's check for common symptoms:" <<endl;
+    askNextQuestion();
+}
+
+// Asks about the symptom that best splits the diseases still possible, or ends the interview
+void TriageSession::askNextQuestion()
+{
+    questionSymptom = interview.nextQuestion();
+    if (questionSymptom < 0)
+    {
+        finishInterview();
+        return;
+    }
+    out<<"Do you have " << catalog->kb.symptomName(questionSymptom) << "?" << " (yes/no): ";
+    state = SessionState::Question;
+}
+
+void TriageSession::finishInterview()
+{
+    interview.finish();
+    // If no symptom was reported, ask for specific symptoms
+    if (numSymptomsReported == 0)
+    {
+        startSymptomSearch();
+    }
+    else
+    {
+        identifyDiseases();
+    }
+}
+
+// Lets the user add further symptoms by prefix search; the best completions are numbered for picking
+void TriageSession::startSymptomSearch()
+{
+    suggestions.clear();
+    out<<"\n - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - "<<endl;
+    out<<"No symptoms selected so far. Please add the symptoms you are experiencing." <<endl;
+    out<<"Type the beginning of a symptom to see suggestions, the number of a suggestion to add it," <<endl;
+    out<<"several symptoms separated by commas, or 'done' when finished." <<endl;
+    promptSymptomSearch();
+}
+
+void TriageSession::promptSymptomSearch()
+{
+    out<<"Symptom: ";
+    state = SessionState::SymptomSearch;
+}
+
+void TriageSession::addSymptom(int symptomId)
+{
+    // picking one twice sets the same bit
+    userSymptoms.add(symptomId);
+    out<<"Added " << catalog->kb.symptomName(symptomId) <<endl;
+}
+
+// Ranks the diseases matching the reported symptoms and shows them
+void TriageSession::identifyDiseases()
+{
+    // Rank the diseases that match at least one symptom
+    diagnosis = diagnose(*catalog, userSymptoms);
+    const vector<DiseaseMatch>& matchingDiseases = diagnosis->matches;
+    numPredicted += matchingDiseases.size();
+
+    out<<"\nSuggested diseases based on symptoms:" <<endl;
+    for (size_t i = 0; i < matchingDiseases.size(); ++i)
+    {
+        out<<i + 1 << ". " << catalog->kb.diseaseName(matchingDiseases[i].diseaseId) << " (" << static_cast<int>(matchingDiseases[i].score * 100 + 0.5) << "% match)" <<endl;
+    }
+
+    if (matchingDiseases.empty())
+    {
+        out<<"No diseases matched your symptoms. Exiting..." <<endl;
+        showMenu();
+        return;
+    }
+    out<<"Do you want to perform tests to narrow down the diagnosis? (Y/N): ";
+    state = SessionState::OfferTests;
+}
+
+void TriageSession::promptDiseaseChoice()
+{
+    out<<"\nEnter the number of the disease to view details (0 to exit, -1 to choose other diseases): ";
+    state = SessionState::ChooseDisease;
+}
+
+void TriageSession::onIdentification(const string& line)
+{
+    const KnowledgeBase& kb = catalog->kb;
+    switch (state)
+    {
+    case SessionState::Question:
+    {
+        int answer = parseYesNo(line);
+        if (answer < 0)
+        {
+            out<<"Invalid input. Please enter 'yes' or 'no'." <<endl;
+            out<<"Do you have " << kb.symptomName(questionSymptom) << "?" << " (yes/no): ";
+            return;
+        }
+        if (answer == 1)
+        {
+            numYesResponses++;
+            numSymptomsReported++;
+            userSymptoms.add(questionSymptom);
+        }
+        interview.answer(questionSymptom, answer == 1);
+        askNextQuestion();
+        break;
+    }
+    case SessionState::SymptomSearch:
+    {
+        string entry = normaliseSymptom(line);
+        if (entry.empty() || entry == "done")
+        {
+            identifyDiseases();
+            return;
+        }
+        if (isNumeric(entry))
+        {
+            int number = entry.size() < 6 ? stoi(entry) : 0;
+            if (number > 0 && number <= static_cast<int>(suggestions.size()))
+                addSymptom(suggestions[number - 1]);
+            else
+                out<<"Invalid selection. Please enter a number from the suggestions." <<endl;
+        }
+        else if (entry.find_first_of(",;") != string::npos)
+        {
+            // typed symptoms are matched against symptom names and synonyms, small typos are tolerated
+            for (const string& typed : splitList(line, ",;"))
+            {
+                int id = catalog->symptomMatcher.resolve(typed);
+                if (id >= 0)
+                    addSymptom(id);
+                else
+                    out<<"Symptom not recognised: " << typed <<endl;
+            }
+        }
+        else if (kb.findSymptom(entry) >= 0)
+        {
+            addSymptom(kb.findSymptom(entry));
+        }
+        else
+        {
+            suggestions = catalog->symptomCompleter.complete(entry, MAX_COMPLETIONS);
+            if (suggestions.empty())
+            {
+                // no symptom starts like this, offer the closest spelling instead
+                int id = catalog->symptomMatcher.resolve(entry);
+                if (id >= 0)
+                    suggestions.push_back(id);
+            }
+            if (suggestions.empty())
+            {
+                out<<"Symptom not recognised: " << trim(line) <<endl;
+            }
+            for (size_t i = 0; i < suggestions.size(); ++i)
+            {
+                out<<setw(2) << i + 1 << ". " << kb.symptomName(suggestions[i]) << " (" << kb.postings(suggestions[i]).size() << " diseases)" <<endl;
+            }
+        }
+        promptSymptomSearch();
+        break;
+    }
+    case SessionState::OfferTests:
+        if (isYes(line))
+        {
+            // List of symptoms for suggesting tests
+            suggestTests(out, diagnosis->tests);
+        }
+        provideDoctorDetails(out);
+        promptDiseaseChoice();
+        break;
+    case SessionState::ChooseDisease:
+    {
+        string choice = trim(line);
+        if (choice == "0")
+        {
+            showBill();
+            return;
+        }
+        if (choice == "-1")
+        {
+            out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+            out<<"\n     RETURNING TO DISEASE IDENTIFICATION WINDOW    "<<endl;
+            out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+            startIdentification(); // Allows the user to choose another disease
+            return;
+        }
+        int number = 0;
+        auto parsed = from_chars(choice.data(), choice.data() + choice.size(), number);
+        if (parsed.ec == errc::invalid_argument)
+        {
+            out<<"Invalid input. Please enter a valid number." <<endl;
+            promptDiseaseChoice();
+            return;
+        }
+        int index = number - 1;
+        if (parsed.ec != errc() || index < 0 || index >= static_cast<int>(diagnosis->matches.size()))
+        {
+            out<<"Invalid index. Please enter a valid number within the range." <<endl;
+            promptDiseaseChoice();
+            return;
+        }
+
+        selectedDisease = diagnosis->matches[index].diseaseId;
+        if (viewedDiseases.count(selectedDisease) > 0)
+        {
+            out<<"You have already viewed details for " << kb.diseaseName(selectedDisease) << ". Please choose another disease." <<endl;
+            promptDiseaseChoice();
+            return;
+        }
+        viewDiseaseDetails(out, kb, selectedDisease, viewedDiseases);
+        numDetailsDisplayed++;
+        out<<"Do you want to view treatments for " << kb.diseaseName(selectedDisease) << "?" << " (yes/no): ";
+        state = SessionState::OfferTreatments;
+        break;
+    }
+    case SessionState::OfferTreatments:
+    {
+        int answer = parseYesNo(line);
+        if (answer < 0)
+        {
+            out<<"Invalid input. Please enter 'yes' or 'no'." <<endl;
+            out<<"Do you want to view treatments for " << kb.diseaseName(selectedDisease) << "?" << " (yes/no): ";
+            return;
+        }
+        if (answer == 1)
+        {
+            out<<"\nTreatments for " << kb.diseaseName(selectedDisease) << ":" <<endl;
+            for (const auto &treatment : kb.diseaseTreatments(selectedDisease))
+            {
+                out<<"- " << kb.text(treatment) <<endl;
+            }
+            numMedicationsDisplayed++;
+        }
+        promptDiseaseChoice();
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void TriageSession::showBill()
+{
+    StageTimer timer(Stage::CalculateBill);
+    diagnosis.reset();
+    catalog.reset();
+    bill = calculateBill(numPredicted, numDetailsDisplayed, numMedicationsDisplayed, numYesResponses);
+
+    // usage is priced and logged now, whether or not the bill gets paid
+    BillingLedger& ledger = services.ledger;
+    if (!ledger.record(sessionId, loggedInId, LedgerEvent::Prediction, numPredicted, PREDICTION_FEE * numPredicted) ||
+        !ledger.record(sessionId, loggedInId, LedgerEvent::DetailsViewed, numDetailsDisplayed, DETAILS_FEE * numDetailsDisplayed) ||
+        !ledger.record(sessionId, loggedInId, LedgerEvent::MedicationViewed, numMedicationsDisplayed, MEDICATION_FEE * numMedicationsDisplayed) ||
+        !ledger.record(sessionId, loggedInId, LedgerEvent::YesResponse, numYesResponses, YES_RESPONSE_FEE * numYesResponses))
+    {
+        cerr<<"WARNING! The billing ledger could not be written" <<endl;
+    }
+
+    // Display the bill to the user
+    out<<"\n********************"<<endl;
+    out<<"* THANK YOU FOR USING THE DISEASE IDENTIFYING SYSTEM *" <<endl;
+    out<<"********************"<<endl;
+
+    //bill-
+    out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+    out<<"\n\nYour bill for using the system is: $" << formatMoney(bill) <<endl;
+    out<<"- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -"<<endl;
+
+    out<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-\n";
+    out<<"*       P A Y M E N T   W I N D O W        *\n";
+    out<<"*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-*-\n";
+    out<<"Enter C for CASH and O for ONLINE:"<<endl;
+    out<<"Choose mode of payment: ";
+    state = SessionState::PaymentMode;
+}
+
+void TriageSession::recordPayment()
+{
+    StageTimer timer(Stage::Payment);
+    countEvent(Counter::Payments);
+    if (!services.ledger.record(sessionId, loggedInId, LedgerEvent::Payment, 1, bill))
+    {
+        cerr<<"WARNING! The billing ledger could not be written" <<endl;
+    }
+}
+
+void TriageSession::finishPayment()
+{
+    out<<"\n****************************************************"<<endl;
+    out<<"*     E X I T I N G   P A Y M E N T   W I N D O W    *"<<endl;
+    out<<"\n****************************************************"<<endl;
+
+    // Provide feedback option
+    out<<"\nWould you like to provide feedback about your experience? (Y/N): ";
+    state = SessionState::OfferFeedback;
+}
+
+// Cash payment gives change; online payment simulates a transaction through one of the allowed banks
+void TriageSession::onPayment(const string& line)
+{
+    switch (state)
+    {
+    case SessionState::PaymentMode:
+    {
+        string mode = trim(line);
+        char paymentMode = mode.empty() ? ' ' : mode[0];
+        if (paymentMode == 'C' || paymentMode == 'c')
+        {
+            out<<"\n- - - - - - - - - - - - - - - - - - - - - \n";
+            out<<"|                   C A S H                |\n";
+            out<<"- - - - - - - - - - - - - - - - - - - - - - \n";
+            out<<"Enter cash: ";
+            state = SessionState::CashAmount;
+        }
+        else if (paymentMode == 'O' || paymentMode == 'o')
+        {
+            out<<"\n- - - - - - - - - - - - - - - - - - - - - \n";
+            out<<"|                 O N L I N E              |\n";
+            out<<"- - - - - - - - - - - - - - - - - - - - - \n";
+            // Bank details
+            out<<"Enter your bank details for Online payment:" <<endl;
+            out<<"Bank Name: ";
+            state = SessionState::BankName;
+        }
+        else
+        {
+            finishPayment();
+        }
+        break;
+    }
+    case SessionState::CashAmount:
+    {
+        Paise cash_amt = 0;
+        if (!parseMoney(trim(line), cash_amt))
+        {
+            out<<"Invalid amount. Enter cash: ";
+            return;
+        }
+        bool flag = calculateChange(out, bill, cash_amt);
+        if (flag == true)
+        {
+            recordPayment();
+            out<<"Transaction of Rs." << formatMoney(bill) <<" is successful"<<endl;
+        }
+        finishPayment();
+        break;
+    }
+    case SessionState::BankName:
+    {
+        string uppercaseBankName = toUppercase(trim(line));
+
+        // Check if the entered bank name matches any allowed bank name or its substring
+        bool validBank = false;
+        for (const string& bnk : BANK_NAMES)
+        {
+            string uppercaseBnk = toUppercase(bnk);
+            if (!uppercaseBankName.empty() && (uppercaseBankName.find(uppercaseBnk) != string::npos || uppercaseBnk.find(uppercaseBankName) != string::npos))
+            {
+                validBank = true;
+                bankName = bnk; // Set bank name to the full name from the list
+                break;
+            }
+        }
+        if (!validBank)
+        {
+            out<<"Invalid bank name. Please enter a valid bank name from the list." <<endl;
+            finishPayment();
+            return;
+        }
+        out<<"Account Number: ";
+        state = SessionState::AccountNumber;
+        break;
+    }
+    case SessionState::AccountNumber:
+        out<<"CVV: ";
+        state = SessionState::Cvv;
+        break;
+    case SessionState::Cvv:
+        // Payment processing simulation-
+        out<<"Processing Online Payment through " << bankName << " bank..." <<endl;
+        out<<"\nPlease wait while we connect you to the " << bankName << " payment gateway." <<endl;
+        out<<"\nPayment authorization in progress..." <<endl;
+        recordPayment();
+        out<<"Payment of Rs. " << formatMoney(bill) << " through " << bankName << " bank is successful." <<endl;
+        out<<"Transaction of Rs." << formatMoney(bill) <<" is successful"<<endl;
+        finishPayment();
+        break;
+    default:
+        break;
+    }
+}
+
+void TriageSession::onFeedback(const string& line)
+{
+    switch (state)
+    {
+    case SessionState::OfferFeedback:
+        if (!isYes(line))
+        {
+            close();
+            return;
+        }
+        feedback = Feedback();
+        out<<"****************\n";
+        out<<"*      F E E D B A C K   W I N D O W       *\n";
+        out<<"****************\n\n";
+        out<<"\nThank you for choosing to provide feedback!" <<endl;
+        out<<"Please answer the following questions:\n" <<endl;
+        out<<"------------------------------------------------" <<endl;
+        out<<"How would you rate your overall experience out of 5? ";
+        state = SessionState::FeedbackRating;
+        break;
+    case SessionState::FeedbackRating:
+    {
+        string rating = trim(line);
+        if (rating.size() != 1 || rating[0] < '0' || rating[0] > '5')
+        {
+            out<<"Please enter a rating from 0 to 5: ";
+            return;
+        }
+        feedback.overallExperienceRating = rating[0] - '0';
+        out<<"------------------------------------------------" <<endl;
+        out<<"Do you have any suggestions for improvement? (yes/no): ";
+        state = SessionState::FeedbackHasSuggestions;
+        break;
+    }
+    case SessionState::FeedbackHasSuggestions:
+        if (parseYesNo(line) == 1)
+        {
+            out<<"Please provide your suggestions: ";
+            state = SessionState::FeedbackSuggestions;
+            return;
+        }
+        out<<"------------------------------------------------" <<endl;
+        out<<"Were your concerns addressed adequately? (yes/no): ";
+        state = SessionState::FeedbackConcerns;
+        break;
+    case SessionState::FeedbackSuggestions:
+        feedback.improvementSuggestions = line;
+        out<<"------------------------------------------------" <<endl;
+        out<<"Were your concerns addressed adequately? (yes/no): ";
+        state = SessionState::FeedbackConcerns;
+        break;
+    case SessionState::FeedbackConcerns:
+        feedback.concernsAddressed = parseYesNo(line) == 1;
+        if (!feedback.concernsAddressed)
+        {
+            out<<"Please provide the reason for your concerns: ";
+            state = SessionState::FeedbackConcernReason;
+            return;
+        }
+        out<<"------------------------------------------------" <<endl;
+        out<<"Were you provided with enough information about your condition and treatment options? (yes/no): ";
+        state = SessionState::FeedbackEnoughInformation;
+        break;
+    case SessionState::FeedbackConcernReason:
+        feedback.concernReason = line;
+        out<<"------------------------------------------------" <<endl;
+        out<<"Were you provided with enough information about your condition and treatment options? (yes/no): ";
+        state = SessionState::FeedbackEnoughInformation;
+        break;
+    case SessionState::FeedbackEnoughInformation:
+        feedback.enoughInformationProvided = parseYesNo(line) == 1;
+        if (!feedback.enoughInformationProvided)
+        {
+            out<<"Please consult a doctor for more information." <<endl;
+        }
+        out<<"------------------------------------------------" <<endl;
+        out<<"Please provide any additional comments or suggestions (press - if none): ";
+        state = SessionState::FeedbackComments;
+        break;
+    case SessionState::FeedbackComments:
+        feedback.additionalComments = line;
+        feedback.patientId = loggedInId;
+        feedback.submitted = time(0);
+        if (!services.feedback.append(feedback))
+        {
+            out<<"ERROR! Your feedback could not be saved." <<endl;
+        }
+        showMenu();
+        break;
+    default:
+        break;
+    }
+}
+
+// Runs one session on the terminal. Returns 1 if the user never logged in.
+int runConsole(TriageServices& services)
+{
+    TriageSession session(services);
+    session.start();
+    cout<<session.takeOutput() << flush;
+    string line;
+    while (!session.finished() && getline(cin, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        session.handleLine(line);
+        cout<<session.takeOutput() << flush;
+    }
+    return session.loggedIn() ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Triage server (--serve).
+// Listens on a loopback TCP port or a Unix socket and runs one TriageSession per connection. A single
+// epoll loop multiplexes every connection, so thousands of sessions share one process, one patient
+// store and one knowledge base. Input is handed to a session a line at a time and its output is
+// written back as fast as the socket accepts it. Password hashing and checks go to the
+// PasswordWorkers; a session waiting for one keeps its further lines until the result is back.
+// ---------------------------------------------------------------------------------------------
+
+// A connection is dropped when it sends a line longer than this
+const size_t SERVER_MAX_LINE = 1 << 16;
+
+struct Connection
+{
+    int fd;
+    string input;  // received, not yet a complete line
+    string output; // produced, not yet sent
+    bool inputClosed = false; // the peer has shut down its sending side
+    uint32_t events = EPOLLIN; // what epoll watches the socket for
+    unique_ptr<TriageSession> session;
+};
+
+volatile sig_atomic_t serverStopping = 0;
+
+void stopServer(int)
+{
+    serverStopping = 1;
+}
+
+// Opens the listening socket: a number is a TCP port on 127.0.0.1, anything else a Unix socket path
+int openListener(const string& address)
+{
+    int fd;
+    bool isPort = isNumeric(address) && address.size() <= 5;
+    if (isPort)
+    {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(stoi(address)));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        sockaddr_un addr = {};
+        if (address.size() >= sizeof(addr.sun_path))
+            return -1;
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, address.c_str(), address.size() + 1);
+        unlink(address.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, SOMAXCONN) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+class TriageServer
+{
+public:
+    explicit TriageServer(TriageServices& services) : services(services) {}
+    ~TriageServer();
+
+    // Serves until SIGINT or SIGTERM, returns false if the socket cannot be opened
+    bool run(const string& address);
+
+private:
+    void acceptConnections();
+    void readFrom(Connection& c);
+    void handleLines(Connection& c);
+    void passwordsDone(PasswordWorkers& workers);
+    void flush(Connection& c);
+    void closeConnection(int fd);
+
+    TriageServices& services;
+    int epollFd = -1;
+    int listenFd = -1;
+    unordered_map<int, unique_ptr<Connection>> connections;
+    unordered_map<uint64_t, int> sessionFds; // session id to its connection, for finished password jobs
+};
+
+TriageServer::~TriageServer()
+{
+    for (auto& entry : connections)
+        ::close(entry.first);
+    if (listenFd >= 0)
+        ::close(listenFd);
+    if (epollFd >= 0)
+        ::close(epollFd);
+}
+
+bool TriageServer::run(const string& address)
+{
+    listenFd = openListener(address);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (listenFd < 0 || epollFd < 0)
+        return false;
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+
+    // one worker per core; the epoll thread itself only waits on them
+    PasswordWorkers workers(max(1u, thread::hardware_concurrency()));
+    if (workers.completionFd() >= 0)
+    {
+        ev.data.fd = workers.completionFd();
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, workers.completionFd(), &ev);
+        services.passwordWorkers = &workers;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop = {};
+    stop.sa_handler = stopServer;
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGTERM, &stop, nullptr);
+    cout<<"Serving triage sessions on " << address <<endl;
+
+    vector<epoll_event> events(1024);
+    auto lastLogSync = chrono::steady_clock::now();
+    auto lastFeedbackFlush = lastLogSync;
+    while (!serverStopping)
+    {
+        // wakes up at least every LOG_SYNC_INTERVAL_MS, busy or not, so a registration or bill is synced
+        // within that time even when no other one follows it, and buffered feedback within
+        // FEEDBACK_FLUSH_INTERVAL_MS
+        int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), LOG_SYNC_INTERVAL_MS);
+        if (ready < 0 && errno != EINTR)
+        {
+            services.passwordWorkers = nullptr;
+            return false;
+        }
+        auto now = chrono::steady_clock::now();
+        if (now - lastLogSync >= chrono::milliseconds(LOG_SYNC_INTERVAL_MS))
+        {
+            services.patients.sync();
+            services.patients.compactInBackground();
+            services.ledger.sync();
+            lastLogSync = now;
+        }
+        if (now - lastFeedbackFlush >= chrono::milliseconds(FEEDBACK_FLUSH_INTERVAL_MS))
+        {
+            services.feedback.sync();
+            if (services.journal)
+                services.journal->flush();
+            lastFeedbackFlush = now;
+        }
+        for (int i = 0; i < ready; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listenFd)
+            {
+                acceptConnections();
+                continue;
+            }
+            if (fd == workers.completionFd())
+            {
+                passwordsDone(workers);
+                continue;
+            }
+            auto it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+            Connection& c = *it->second;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                readFrom(c); // may close the connection
+            else if (events[i].events & EPOLLOUT)
+                flush(c);
+        }
+    }
+    services.passwordWorkers = nullptr;
+    services.patients.sync();
+    services.feedback.sync();
+    services.ledger.sync();
+    const ResultCache& cache = services.catalogs.current()->resultCache;
+    cout<<"Result cache: " << cache.hits() << " hits, " << cache.misses() << " misses" <<endl;
+    return true;
+}
+
+void TriageServer::acceptConnections()
+{
+    while (true)
+    {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return; // EAGAIN: no more pending connections
+        auto c = make_unique<Connection>();
+        c->fd = fd;
+        c->session = make_unique<TriageSession>(services);
+        c->session->start();
+        c->output = c->session->takeOutput();
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+        Connection& ref = *c;
+        sessionFds.emplace(c->session->id(), fd);
+        connections.emplace(fd, move(c));
+        flush(ref);
+    }
+}
+
+void TriageServer::readFrom(Connection& c)
+{
+    char buffer[4096];
+    while (true)
+    {
+        ssize_t got = read(c.fd, buffer, sizeof(buffer));
+        if (got > 0)
+        {
+            c.input.append(buffer, got);
+            continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+        {
+            closeConnection(c.fd);
+            return;
+        }
+        // end of input: the lines already received are still answered before the connection is closed
+        c.inputClosed = true;
+        break;
+    }
+    handleLines(c);
+}
+
+// Hands the session every complete line received, until it finishes or waits for a password job
+void TriageServer::handleLines(Connection& c)
+{
+    size_t start = 0;
+    size_t newline;
+    while (!c.session->finished() && !c.session->busy() && (newline = c.input.find('\n', start)) != string::npos)
+    {
+        string line = c.input.substr(start, newline - start);
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        c.session->handleLine(line);
+        c.output += c.session->takeOutput();
+        start = newline + 1;
+    }
+    c.input.erase(0, start);
+    if (c.input.size() > SERVER_MAX_LINE)
+    {
+        closeConnection(c.fd);
+        return;
+    }
+    flush(c);
+}
+
+// Gives each finished password job back to its session, if the connection is still open
+void TriageServer::passwordsDone(PasswordWorkers& workers)
+{
+    for (const PasswordJob& job : workers.takeFinished())
+    {
+        auto session = sessionFds.find(job.sessionId);
+        if (session == sessionFds.end())
+            continue;
+        Connection& c = *connections.at(session->second);
+        c.session->passwordDone(job);
+        c.output += c.session->takeOutput();
+        handleLines(c); // may close the connection
+    }
+}
+
+// Sends what the socket takes; closes the connection once all output is sent and the session has
+// finished, or the peer has no more input and the session is not waiting for a password job
+void TriageServer::flush(Connection& c)
+{
+    while (!c.output.empty())
+    {
+        ssize_t sent = write(c.fd, c.output.data(), c.output.size());
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            closeConnection(c.fd);
+            return;
+        }
+        c.output.erase(0, sent);
+    }
+    if (c.output.empty() && (c.session->finished() || (c.inputClosed && !c.session->busy())))
+    {
+        closeConnection(c.fd);
+        return;
+    }
+    // only ask for writability while output is waiting, and stop reading at the end of input
+    bool wantsWrite = !c.output.empty();
+    uint32_t events = (c.inputClosed ? 0u : uint32_t(EPOLLIN)) | (wantsWrite ? uint32_t(EPOLLOUT) : 0u);
+    if (events != c.events)
+    {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = c.fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+        c.events = events;
+    }
+}
+
+void TriageServer::closeConnection(int fd)
+{
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    auto it = connections.find(fd);
+    sessionFds.erase(it->second->session->id());
+    connections.erase(it);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Journal replay (--replay).
+// Feeds recorded journals back through fresh sessions, without a terminal or sockets. Events keep
+// their recorded spacing divided by the speed factor (speed 0 replays as fast as possible), and the
+// sessions overlap exactly as they did when recorded, all on one thread like the server. Replayed
+// sessions use the patient, feedback and billing stores of the current directory, so replay against
+// a copy of them. Accepted passwords come back as the given fixture password; without one the
+// placeholder is typed, so recorded registrations still work but recorded logins fail.
+// ---------------------------------------------------------------------------------------------
+
+struct ReplayStats
+{
+    size_t sessions = 0;
+    size_t peakSessions = 0;
+    size_t lines = 0;
+    size_t outputBytes = 0;
+    chrono::nanoseconds busy{0};        // time spent inside the sessions
+    chrono::nanoseconds slowestLine{0};
+    chrono::nanoseconds maxLag{0};      // how far behind schedule an event was handled
+    chrono::nanoseconds elapsed{0};
+};
+
+bool replayJournals(TriageServices& services, const vector<string>& paths, double speed, const string& password, ReplayStats& stats)
+{
+    vector<MappedFile> files(paths.size());
+    vector<JournalEntry> entries;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        if (!files[i].open(paths[i]))
+        {
+            cout<<"ERROR! Cannot open journal " << paths[i] <<endl;
+            return false;
+        }
+        readJournal(files[i], paths[i], entries);
+    }
+    // journals recorded side by side are interleaved by time
+    stable_sort(entries.begin(), entries.end(), [](const JournalEntry& a, const JournalEntry& b) { return a.time < b.time; });
+
+    unordered_map<uint64_t, unique_ptr<TriageSession>> sessions;
+    auto begin = chrono::steady_clock::now();
+    int64_t firstTime = entries.empty() ? 0 : entries.front().time;
+    for (const JournalEntry& entry : entries)
+    {
+        if (speed > 0)
+        {
+            auto due = begin + chrono::microseconds(static_cast<int64_t>((entry.time - firstTime) / speed));
+            auto now = chrono::steady_clock::now();
+            if (now < due)
+                this_thread::sleep_until(due);
+            else
+                stats.maxLag = max(stats.maxLag, chrono::duration_cast<chrono::nanoseconds>(now - due));
+        }
+
+        auto started = chrono::steady_clock::now();
+        auto it = sessions.find(entry.session);
+        if (entry.type == JournalEvent::Close)
+        {
+            if (it != sessions.end())
+                sessions.erase(it);
+            continue;
+        }
+        // a journal started while a session was running has lines without an open; they start one
+        if (it == sessions.end())
+        {
+            it = sessions.emplace(entry.session, make_unique<TriageSession>(services)).first;
+            it->second->start();
+            stats.sessions++;
+            stats.peakSessions = max(stats.peakSessions, sessions.size());
+        }
+        TriageSession& session = *it->second;
+        if ((entry.type == JournalEvent::Line || entry.type == JournalEvent::Secret) && !session.finished())
+        {
+            bool accepted = entry.type == JournalEvent::Secret && !entry.line.empty() &&
+                            entry.line.find_first_not_of(SECRET_ACCEPTED) == string_view::npos;
+            session.handleLine(accepted && !password.empty() ? password : string(entry.line));
+            stats.lines++;
+        }
+        stats.outputBytes += session.takeOutput().size();
+        auto spent = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started);
+        stats.busy += spent;
+        stats.slowestLine = max(stats.slowestLine, spent);
+    }
+    sessions.clear();
+    stats.elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin);
+    return true;
+}
+
+void printReplayStats(const ReplayStats& stats)
+{
+    double seconds = stats.elapsed.count() / 1e9;
+    cout<<"Sessions replayed: " << stats.sessions << " (at most " << stats.peakSessions << " at once)" <<endl;
+    cout<<"Lines replayed: " << stats.lines << " in " << fixed << setprecision(3) << seconds << " s";
+    if (seconds > 0)
+        cout<<" (" << setprecision(0) << stats.lines / seconds << " lines/s)";
+    cout<<endl;
+    cout<<"Time in sessions: " << setprecision(3) << stats.busy.count() / 1e6 << " ms, mean "
+        << (stats.lines ? stats.busy.count() / 1e3 / stats.lines : 0.0) << " us/line, slowest " << stats.slowestLine.count() / 1e3 << " us" <<endl;
+    cout<<"Output: " << stats.outputBytes << " bytes, most behind schedule: " << stats.maxLag.count() / 1e6 << " ms" <<endl;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Headless batch diagnosis (--batch).
+// Reads one intake record per line, "patient ID <TAB> symptom; symptom; ...", runs the same ranking
+// as the identification window and writes one result line per record, either as TSV
+//   patient ID <TAB> disease=score; ... <TAB> test; ... <TAB> unknown symptom; ...
+// or as a JSON object per line (--json). Output is collected in a large buffer and written in blocks,
+// nothing is flushed per record.
+// ---------------------------------------------------------------------------------------------
+
+// Output buffered before it is written out
+const size_t BATCH_OUTPUT_BUFFER = 1 << 16;
+
+// Appends str to out with the characters JSON requires escaped
+void appendJsonString(string& out, string_view str)
+{
+    out += '"';
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Diagnoses one input record and appends its result line to out. Returns false for a blank line.
+bool diagnoseRecord(const Catalog& catalog, string_view line, bool json, string& out)
+{
+    const KnowledgeBase& kb = catalog.kb;
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+    size_t tab = line.find('\t');
+    string_view patientId = line.substr(0, tab);
+    string_view symptomList = tab == string_view::npos ? string_view() : line.substr(tab + 1);
+    if (patientId.empty() && symptomList.empty())
+        return false;
+
+    // resolve the symptoms to IDs, tolerating typos and synonyms; anything unrecognised is reported back
+    ScratchScope scope;
+    thread_local SymptomSet symptoms;
+    symptoms.words.assign(kb.symptomWords(), 0);
+    ScratchVector<string_view> unknown;
+    while (!symptomList.empty())
+    {
+        size_t sep = symptomList.find_first_of(";,");
+        string_view item = symptomList.substr(0, sep);
+        symptomList = sep == string_view::npos ? string_view() : symptomList.substr(sep + 1);
+        while (!item.empty() && isspace(static_cast<unsigned char>(item.front())))
+            item.remove_prefix(1);
+        while (!item.empty() && isspace(static_cast<unsigned char>(item.back())))
+            item.remove_suffix(1);
+        if (item.empty())
+            continue;
+        int id = catalog.symptomMatcher.resolve(item);
+        if (id >= 0)
+            symptoms.add(id);
+        else
+            unknown.push_back(item);
+    }
+
+    shared_ptr<const DiagnosisResult> diagnosis = diagnose(catalog, symptoms);
+    const vector<DiseaseMatch>& matches = diagnosis->matches;
+    const vector<string_view>& tests = diagnosis->tests;
+
+    char score[16];
+    if (json)
+    {
+        out += "{\"patient\":";
+        appendJsonString(out, patientId);
+        out += ",\"diseases\":[";
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            out += i ? ",{\"name\":" : "{\"name\":";
+            appendJsonString(out, kb.diseaseName(matches[i].diseaseId));
+            snprintf(score, sizeof(score), "%.3f", matches[i].score);
+            out += ",\"score\":";
+            out += score;
+            out += '}';
+        }
+        out += "],\"tests\":[";
+        for (size_t i = 0; i < tests.size(); ++i)
+        {
+            if (i)
+                out += ',';
+            appendJsonString(out, tests[i]);
+        }
+        out += "],\"unknown\":[";
+        for (size_t i = 0; i < unknown.size(); ++i)
+        {
+            if (i)
+                out += ',';
+            appendJsonString(out, unknown[i]);
+        }
+        out += "]}\n";
+    }
+    else
+    {
+        out.append(patientId.data(), patientId.size());
+        out += '\t';
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            if (i)
+                out += "; ";
+            out += kb.diseaseName(matches[i].diseaseId);
+            snprintf(score, sizeof(score), "=%.3f", matches[i].score);
+            out += score;
+        }
+        out += '\t';
+        for (size_t i = 0; i < tests.size(); ++i)
+        {
+            if (i)
+                out += "; ";
+            out += tests[i];
+        }
+        out += '\t';
+        for (size_t i = 0; i < unknown.size(); ++i)
+        {
+            if (i)
+                out += "; ";
+            out += unknown[i];
+        }
+        out += '\n';
+    }
+    return true;
+}
+
+// Runs the batch over every line of in, writing results to out. Returns the number of records.
+size_t runBatch(const Catalog& catalog, istream& in, FILE* out, bool json)
+{
+    size_t records = 0;
+    string line;
+    string buffer;
+    buffer.reserve(BATCH_OUTPUT_BUFFER + 4096);
+    while (getline(in, line))
+    {
+        if (diagnoseRecord(catalog, line, json, buffer))
+            records++;
+        if (buffer.size() >= BATCH_OUTPUT_BUFFER)
+        {
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+    }
+    fwrite(buffer.data(), 1, buffer.size(), out);
+    fflush(out);
+    return records;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Parallel batch pipeline (--batch --threads N).
+// A reader cuts the input into blocks of whole lines, a pool of scoring workers diagnoses the blocks and
+// a writer puts the results back in input order. Every worker has its own deque of blocks; the reader
+// deals blocks out round-robin, a worker takes from the front of its own deque and, when that is empty,
+// steals from the back of another one, so a slow block never leaves the other cores idle. All workers
+// read the same immutable knowledge base. The number of blocks in flight is bounded, so memory stays
+// flat however large the input is.
+// ---------------------------------------------------------------------------------------------
+
+// Bytes of input per block handed to a worker, and blocks in flight per worker
+const size_t BATCH_BLOCK_BYTES = 1 << 18;
+const size_t BATCH_BLOCKS_PER_WORKER = 4;
+
+struct BatchBlock
+{
+    size_t sequence; // position in the input, the writer emits blocks in this order
+    string input;    // whole lines
+    string output;
+};
+
+struct BatchWorkerQueue
+{
+    mutex lock;
+    deque<unique_ptr<BatchBlock>> blocks;
+};
+
+class BatchPipeline
+{
+public:
+    BatchPipeline(const Catalog& catalog, bool json, unsigned workers)
+        : catalog(catalog), json(json), queues(workers), maxInFlight(workers * BATCH_BLOCKS_PER_WORKER) {}
+
+    // Runs reader, workers and writer to completion, returns the number of records
+    size_t run(istream& in, FILE* out);
+
+private:
+    void readInput(istream& in);
+    void work(size_t self);
+    unique_ptr<BatchBlock> takeBlock(size_t self);
+    void writeOutput(FILE* out);
+
+    const Catalog& catalog;
+    const bool json;
+    vector<BatchWorkerQueue> queues;
+    const size_t maxInFlight;
+
+    // blocks queued for the workers, and the end of input
+    mutex workLock;
+    condition_variable workReady;
+    size_t queued = 0;
+    bool inputDone = false;
+
+    // finished blocks waiting for their turn to be written
+    mutex doneLock;
+    condition_variable blockDone;
+    map<size_t, unique_ptr<BatchBlock>> finished;
+    size_t inFlight = 0;
+    size_t totalBlocks = 0;
+    bool allRead = false;
+    condition_variable slotFree;
+
+    atomic<size_t> records{0};
+};
+
+size_t BatchPipeline::run(istream& in, FILE* out)
+{
+    vector<thread> workers;
+    for (size_t i = 0; i < queues.size(); ++i)
+    {
+        workers.emplace_back(&BatchPipeline::work, this, i);
+    }
+    thread reader(&BatchPipeline::readInput, this, ref(in));
+    writeOutput(out);
+    reader.join();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    return records;
+}
+
+void BatchPipeline::readInput(istream& in)
+{
+    size_t sequence = 0;
+    string carry; // partial last line of the previous read
+    vector<char> buffer(BATCH_BLOCK_BYTES);
+    while (true)
+    {
+        in.read(buffer.data(), buffer.size());
+        size_t got = static_cast<size_t>(in.gcount());
+        bool atEnd = !in;
+        if (got == 0 && carry.empty())
+            break;
+
+        auto block = make_unique<BatchBlock>();
+        block->input.swap(carry);
+        block->input.append(buffer.data(), got);
+        if (!atEnd)
+        {
+            size_t lastNewline = block->input.rfind('\n');
+            if (lastNewline == string::npos)
+            {
+                // a line longer than a block, keep reading until it ends
+                carry.swap(block->input);
+                continue;
+            }
+            carry.assign(block->input, lastNewline + 1, string::npos);
+            block->input.resize(lastNewline + 1);
+        }
+
+        {
+            unique_lock<mutex> guard(doneLock);
+            slotFree.wait(guard, [&] { return inFlight < maxInFlight; });
+            inFlight++;
+        }
+        block->sequence = sequence;
+        BatchWorkerQueue& queue = queues[sequence % queues.size()];
+        sequence++;
+        {
+            lock_guard<mutex> guard(queue.lock);
+            queue.blocks.push_back(move(block));
+        }
+        {
+            lock_guard<mutex> guard(workLock);
+            queued++;
+        }
+        workReady.notify_one();
+        if (atEnd)
+            break;
+    }
+
+    {
+        lock_guard<mutex> guard(doneLock);
+        totalBlocks = sequence;
+        allRead = true;
+    }
+    blockDone.notify_one();
+    {
+        lock_guard<mutex> guard(workLock);
+        inputDone = true;
+    }
+    workReady.notify_all();
+}
+
+unique_ptr<BatchBlock> BatchPipeline::takeBlock(size_t self)
+{
+    // own queue first, oldest block first, so output mostly arrives in order
+    {
+        BatchWorkerQueue& own = queues[self];
+        lock_guard<mutex> guard(own.lock);
+        if (!own.blocks.empty())
+        {
+            unique_ptr<BatchBlock> block = move(own.blocks.front());
+            own.blocks.pop_front();
+            return block;
+        }
+    }
+    // then steal the newest block of another worker
+    for (size_t i = 1; i < queues.size(); ++i)
+    {
+        BatchWorkerQueue& victim = queues[(self + i) % queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.blocks.empty())
+        {
+            unique_ptr<BatchBlock> block = move(victim.blocks.back());
+            victim.blocks.pop_back();
+            return block;
+        }
+    }
+    return nullptr;
+}
+
+void BatchPipeline::work(size_t self)
+{
+    while (true)
+    {
+        {
+            unique_lock<mutex> guard(workLock);
+            workReady.wait(guard, [&] { return queued > 0 || inputDone; });
+            if (queued == 0)
+                return;
+            queued--;
+        }
+        // a block was counted in, so some queue holds one
+        unique_ptr<BatchBlock> block;
+        while (!(block = takeBlock(self)))
+        {
+            this_thread::yield();
+        }
+
+        size_t count = 0;
+        block->output.reserve(block->input.size() * 2);
+        string_view input = block->input;
+        while (!input.empty())
+        {
+            size_t newline = input.find('\n');
+            if (diagnoseRecord(catalog, input.substr(0, newline), json, block->output))
+                count++;
+            input = newline == string_view::npos ? string_view() : input.substr(newline + 1);
+        }
+        records += count;
+        block->input = string();
+
+        {
+            lock_guard<mutex> guard(doneLock);
+            finished.emplace(block->sequence, move(block));
+        }
+        blockDone.notify_one();
+    }
+}
+
+void BatchPipeline::writeOutput(FILE* out)
+{
+    size_t next = 0;
+    while (true)
+    {
+        unique_ptr<BatchBlock> block;
+        {
+            unique_lock<mutex> guard(doneLock);
+            blockDone.wait(guard, [&] { return finished.count(next) > 0 || (allRead && next == totalBlocks); });
+            if (finished.count(next) == 0)
+                break;
+            block = move(finished[next]);
+            finished.erase(next);
+            inFlight--;
+        }
+        slotFree.notify_one();
+        fwrite(block->output.data(), 1, block->output.size(), out);
+        next++;
+    }
+    fflush(out);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Metrics (--metrics).
+// Every thread records into its own ThreadMetrics: a latency histogram per stage of the session flow
+// (see Stage) and the event counters (see Counter). A StageTimer around a stage costs two clock reads
+// and two uncontended stores, so timers sit only on stages that take microseconds or more; result
+// cache hits, which take less, are counted rather than timed. Snapshots sum the blocks of the live
+// threads and the totals of the threads that have exited, and are written in the Prometheus text
+// format: a histogram and p50/p90/p99/p99.9 per stage, then the counters. With --metrics <file> a
+// snapshot replaces the file every METRICS_INTERVAL_MS and once more on exit, ready for the
+// Prometheus node exporter's textfile collector or for reading by hand.
+// ---------------------------------------------------------------------------------------------
+
+const int METRICS_INTERVAL_MS = 10000;
+
+// Histogram bounds exported to Prometheus, in seconds
+const double METRICS_BUCKET_BOUNDS[] = {1e-6, 1e-5, 1e-4, 2.5e-4, 1e-3, 2.5e-3, 1e-2, 2.5e-2, 0.1, 0.25, 1, 2.5, 10};
+const double METRICS_QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {"readPatients", "login", "identifyDiseases", "suggestTests", "calculateBill", "payment", "writePatients"};
+
+struct CounterInfo
+{
+    const char* name;
+    const char* help;
+};
+
+const CounterInfo COUNTER_INFO[COUNTER_COUNT] = {
+    {"triage_sessions_total", "Sessions started."},
+    {"triage_logins_total", "Successful logins."},
+    {"triage_failed_logins_total", "Passwords rejected at login."},
+    {"triage_registrations_total", "Patients registered."},
+    {"triage_diagnoses_total", "Symptom sets diagnosed."},
+    {"triage_result_cache_hits_total", "Diagnoses answered from the result cache."},
+    {"triage_result_cache_misses_total", "Diagnoses computed afresh."},
+    {"triage_disease_matches_total", "Diseases suggested, over all diagnoses."},
+    {"triage_payments_total", "Bills paid."},
+};
+
+// Largest latency, in nanoseconds, that falls in a histogram bucket
+uint64_t bucketUpperBound(size_t bucket)
+{
+    if (bucket < (size_t(1) << HISTOGRAM_SUB_BITS))
+        return bucket;
+    int shift = static_cast<int>(bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t lower = static_cast<uint64_t>((size_t(1) << HISTOGRAM_SUB_BITS) + (bucket & ((size_t(1) << HISTOGRAM_SUB_BITS) - 1))) << shift;
+    return lower + ((uint64_t(1) << shift) - 1);
+}
+
+// Metrics summed over threads
+struct MetricsSnapshot
+{
+    uint64_t latency[STAGE_COUNT][HISTOGRAM_BUCKETS];
+    uint64_t latencyTotal[STAGE_COUNT];
+    uint64_t counters[COUNTER_COUNT];
+
+    void add(const ThreadMetrics& metrics);
+};
+
+void MetricsSnapshot::add(const ThreadMetrics& metrics)
+{
+    for (size_t stage = 0; stage < STAGE_COUNT; ++stage)
+    {
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+            latency[stage][bucket] += metrics.latency[stage][bucket].load(memory_order_relaxed);
+        latencyTotal[stage] += metrics.latencyTotal[stage].load(memory_order_relaxed);
+    }
+    for (size_t counter = 0; counter < COUNTER_COUNT; ++counter)
+        counters[counter] += metrics.counters[counter].load(memory_order_relaxed);
+}
+
+// The blocks of all threads. A thread's block is registered on its first record and folded into the
+// totals of exited threads when it ends, so short-lived connection threads do not pile up.
+class MetricsRegistry
+{
+public:
+    void attach(ThreadMetrics* metrics);
+    void detach(ThreadMetrics* metrics);
+    // Zeroes into, then adds up everything recorded so far
+    void snapshot(MetricsSnapshot& into);
+
+private:
+    mutex lock;
+    vector<ThreadMetrics*> live;
+    MetricsSnapshot exited{};
+};
+
+MetricsRegistry metricsRegistry;
+
+void MetricsRegistry::attach(ThreadMetrics* metrics)
+{
+    lock_guard<mutex> guard(lock);
+    live.push_back(metrics);
+}
+
+void MetricsRegistry::detach(ThreadMetrics* metrics)
+{
+    lock_guard<mutex> guard(lock);
+    exited.add(*metrics);
+    live.erase(find(live.begin(), live.end(), metrics));
+}
+
+void MetricsRegistry::snapshot(MetricsSnapshot& into)
+{
+    lock_guard<mutex> guard(lock);
+    into = exited;
+    for (const ThreadMetrics* metrics : live)
+        into.add(*metrics);
+}
+
+// Hands the block of a thread back to the registry when the thread ends
+struct ThreadMetricsOwner
+{
+    ThreadMetrics* metrics = nullptr;
+
+    ~ThreadMetricsOwner()
+    {
+        if (!metrics)
+            return;
+        metricsRegistry.detach(metrics);
+        metricsOfThread = nullptr;
+        delete metrics;
+    }
+};
+
+ThreadMetrics& registerThreadMetrics()
+{
+    thread_local ThreadMetricsOwner owner;
+    // value-initialised, so every count starts at zero
+    owner.metrics = new ThreadMetrics();
+    metricsRegistry.attach(owner.metrics);
+    metricsOfThread = owner.metrics;
+    return *owner.metrics;
+}
+
+// Writes the snapshot in the Prometheus text exposition format
+void writeMetrics(ostream& out, const MetricsSnapshot& snapshot)
+{
+    out<<setprecision(9);
+    out<<"# HELP triage_stage_seconds Time spent in each stage of the session flow.\n";
+    out<<"# TYPE triage_stage_seconds histogram\n";
+    for (size_t stage = 0; stage < STAGE_COUNT; ++stage)
+    {
+        const uint64_t* latency = snapshot.latency[stage];
+        uint64_t count = 0;
+        size_t bucket = 0;
+        for (double bound : METRICS_BUCKET_BOUNDS)
+        {
+            // a histogram bucket is counted under the first bound none of its values exceeds
+            while (bucket < HISTOGRAM_BUCKETS && bucketUpperBound(bucket) <= bound * 1e9)
+                count += latency[bucket++];
+            out<<"triage_stage_seconds_bucket{stage=\"" << STAGE_NAMES[stage] << "\",le=\"" << bound << "\"} " << count << '\n';
+        }
+        while (bucket < HISTOGRAM_BUCKETS)
+            count += latency[bucket++];
+        out<<"triage_stage_seconds_bucket{stage=\"" << STAGE_NAMES[stage] << "\",le=\"+Inf\"} " << count << '\n';
+        out<<"triage_stage_seconds_sum{stage=\"" << STAGE_NAMES[stage] << "\"} " << snapshot.latencyTotal[stage] / 1e9 << '\n';
+        out<<"triage_stage_seconds_count{stage=\"" << STAGE_NAMES[stage] << "\"} " << count << '\n';
+    }
+
+    out<<"# HELP triage_stage_latency_seconds Latency quantiles of each stage, since start.\n";
+    out<<"# TYPE triage_stage_latency_seconds summary\n";
+    for (size_t stage = 0; stage < STAGE_COUNT; ++stage)
+    {
+        const uint64_t* latency = snapshot.latency[stage];
+        uint64_t count = 0;
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket)
+            count += latency[bucket];
+        if (count == 0)
+            continue;
+        for (double quantile : METRICS_QUANTILES)
+        {
+            // the largest value of the bucket holding the quantile's rank
+            uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(quantile * count)));
+            uint64_t seen = 0;
+            size_t bucket = 0;
+            while ((seen += latency[bucket]) < rank)
+                bucket++;
+            out<<"triage_stage_latency_seconds{stage=\"" << STAGE_NAMES[stage] << "\",quantile=\"" << quantile << "\"} "
+               << bucketUpperBound(bucket) / 1e9 << '\n';
+        }
+        out<<"triage_stage_latency_seconds_sum{stage=\"" << STAGE_NAMES[stage] << "\"} " << snapshot.latencyTotal[stage] / 1e9 << '\n';
+        out<<"triage_stage_latency_seconds_count{stage=\"" << STAGE_NAMES[stage] << "\"} " << count << '\n';
+    }
+
+    for (size_t counter = 0; counter < COUNTER_COUNT; ++counter)
+    {
+        out<<"# HELP " << COUNTER_INFO[counter].name << ' ' << COUNTER_INFO[counter].help << '\n';
+        out<<"# TYPE " << COUNTER_INFO[counter].name << " counter\n";
+        out<<COUNTER_INFO[counter].name << ' ' << snapshot.counters[counter] << '\n';
+    }
+}
+
+// Writes snapshots of the metrics to a file in the background, and a last one when destroyed
+class MetricsReporter
+{
+public:
+    // Does nothing when path is empty
+    explicit MetricsReporter(const string& path);
+    ~MetricsReporter();
+    MetricsReporter(const MetricsReporter&) = delete;
+    MetricsReporter& operator=(const MetricsReporter&) = delete;
+
+    // Replaces the file with a snapshot taken now
+    bool writeSnapshot();
+
+private:
+    void run();
+
+    string path;
+    thread writer;
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;
+};
+
+MetricsReporter::MetricsReporter(const string& path) : path(path)
+{
+    if (!path.empty())
+        writer = thread(&MetricsReporter::run, this);
+}
+
+MetricsReporter::~MetricsReporter()
+{
+    if (path.empty())
+        return;
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+    writeSnapshot();
+}
+
+bool MetricsReporter::writeSnapshot()
+{
+    // written beside the file and renamed over it, so readers never see half a snapshot
+    auto snapshot = make_unique<MetricsSnapshot>();
+    metricsRegistry.snapshot(*snapshot);
+    string tmpPath = path + ".tmp";
+    {
+        ofstream file(tmpPath, ios::trunc);
+        writeMetrics(file, *snapshot);
+        if (!file.flush())
+        {
+            cerr<<"WARNING! Cannot write the metrics to " << tmpPath <<endl;
+            return false;
+        }
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        cerr<<"WARNING! Cannot replace " << path << ": " << strerror(errno) <<endl;
+        return false;
+    }
+    return true;
+}
+
+void MetricsReporter::run()
+{
+    unique_lock<mutex> guard(lock);
+    while (!wake.wait_for(guard, chrono::milliseconds(METRICS_INTERVAL_MS), [this] { return stopping; }))
+    {
+        guard.unlock();
+        writeSnapshot();
+        guard.lock();
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// Benchmarks (--bench).
+// Generates synthetic patient files and disease catalogues of 10^3 entries and up, in steps of ten,
+// and times the hot paths on them: reading and writing the patient snapshot, handing out patient IDs,
+// login lookup, disease matching and test suggestion. Each benchmark repeats its operation until
+// BENCH_MIN_TIME_MS has passed and reports ns/op, heap allocations per op and throughput in items/s.
+// Allocations are counted by the global operator new below. The operator is in every build, so each
+// thread counts into its own thread_local tally, which costs the other modes no shared cache line;
+// a tally is added to a shared total when its thread ends. A benchmark counts the allocations of the
+// thread running it and of the threads it started and joined.
+// ---------------------------------------------------------------------------------------------
+
+// Heap allocations of the threads that have ended
+atomic<uint64_t> exitedAllocations(0);
+
+struct AllocationTally
+{
+    uint64_t count = 0;
+
+    ~AllocationTally() { exitedAllocations.fetch_add(count, memory_order_relaxed); }
+};
+
+thread_local AllocationTally allocationsOfThread;
+
+// Heap allocations made so far by the calling thread and by the threads that have ended
+uint64_t allocationCount()
+{
+    return allocationsOfThread.count + exitedAllocations.load(memory_order_relaxed);
+}
+
+// none of these are inlined, so the compiler does not pair malloc() and free() with new and delete
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    allocationsOfThread.count++;
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+const int BENCH_MIN_TIME_MS = 200;
+// Results are added here so the compiler cannot drop an operation whose result is unused
+volatile size_t benchSink = 0;
+const uint64_t BENCH_SEED = 20240427;
+
+struct BenchResult
+{
+    uint64_t iterations = 0;
+    double nsPerOp = 0;
+    double allocsPerOp = 0;
+    double itemsPerSecond = 0;
+};
+
+// Times op, which handles itemsPerOp items per call, after one warm-up call
+template <typename Op>
+BenchResult runBenchmark(size_t itemsPerOp, Op op)
+{
+    op();
+    BenchResult result;
+    uint64_t allocationsBefore = allocationCount();
+    auto begin = chrono::steady_clock::now();
+    chrono::nanoseconds elapsed(0);
+    do
+    {
+        op();
+        result.iterations++;
+        elapsed = chrono::steady_clock::now() - begin;
+    } while (elapsed < chrono::milliseconds(BENCH_MIN_TIME_MS));
+    result.nsPerOp = static_cast<double>(elapsed.count()) / result.iterations;
+    result.allocsPerOp = static_cast<double>(allocationCount() - allocationsBefore) / result.iterations;
+    result.itemsPerSecond = itemsPerOp * 1e9 / result.nsPerOp;
+    return result;
+}
+
+void printBenchmark(const string& name, size_t size, const BenchResult& result)
+{
+    cout<<left << setw(24) << name << right << setw(10) << size << setw(12) << result.iterations << fixed << setprecision(1)
+        << setw(16) << result.nsPerOp << setw(14) << result.allocsPerOp << setprecision(0) << setw(16) << result.itemsPerSecond <<endl;
+}
+
+// n patients with IDs PID1..PIDn, distinct mobile numbers and random names and dates
+vector<Patient> generatePatients(size_t n, mt19937_64& rng)
+{
+    static const char* const firstNames[] = {"Priyanka", "Manayav", "Deepanshu", "Aarav", "Isha", "Rohan", "Meera", "Kabir", "Ananya", "Vihaan"};
+    static const char* const lastNames[] = {"Jain", "Vatsal", "Agarwal", "Sharma", "Iyer", "Gupta", "Reddy", "Khan", "Das", "Mehta"};
+    vector<Patient> patients(n);
+    char text[32];
+    for (size_t i = 0; i < n; ++i)
+    {
+        Patient& p = patients[i];
+        p.patientId = "PID" + to_string(i + 1);
+        p.password = "pw" + to_string(rng() % 1000000);
+        p.firstName = firstNames[rng() % 10];
+        p.lastName = lastNames[rng() % 10];
+        int year = 1940 + static_cast<int>(rng() % 80);
+        snprintf(text, sizeof(text), "%02d/%02d/%04d", static_cast<int>(rng() % 28) + 1, static_cast<int>(rng() % 12) + 1, year);
+        p.dob = text;
+        p.age = 2024 - year;
+        p.gender = rng() % 2 ? 'M' : 'F';
+        snprintf(text, sizeof(text), "%04d/%02d/%02d", 2015 + static_cast<int>(rng() % 10), static_cast<int>(rng() % 12) + 1, static_cast<int>(rng() % 28) + 1);
+        p.registrationDate = text;
+        p.mobileNumber = to_string(6000000000ull + i * 7919 % 4000000000ull);
+    }
+    return patients;
+}
+
+// n diseases of 3 to 8 symptoms over a vocabulary of n / 4 symptoms (at least 64); symptoms are drawn
+// with a skew so some are common and most are rare, as in a real catalogue
+vector<Disease> generateCatalogue(size_t n, mt19937_64& rng)
+{
+    size_t vocabulary = max<size_t>(64, n / 4);
+    vector<Disease> diseases(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        Disease& d = diseases[i];
+        d.name = "disease " + to_string(i);
+        size_t count = 3 + rng() % 6;
+        while (d.symptoms.size() < count)
+        {
+            // the square of a uniform number favours low symptom numbers
+            double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+            string symptom = "symptom " + to_string(static_cast<size_t>(u * u * vocabulary));
+            if (find(d.symptoms.begin(), d.symptoms.end(), symptom) == d.symptoms.end())
+            {
+                d.symptoms.push_back(symptom);
+                d.weights.push_back(1 + rng() % 3);
+            }
+        }
+        d.treatments = {"rest", "treatment " + to_string(i % 100)};
+    }
+    return diseases;
+}
+
+// Test rules in the format of tests.txt: pairs of common symptoms and a few count rules
+bool writeBenchTestRules(const string& path)
+{
+    ofstream file(path);
+    for (int i = 0; i < 200; ++i)
+        file << "symptom " << i << " + symptom " << (i * 7 + 1) % 200 << "\ttest " << i % 50 << "; test " << (i + 1) % 50 << '\n';
+    file << "any 5\tcomplete blood count\n";
+    file << "any 10\tfull body checkup\n";
+    return static_cast<bool>(file);
+}
+
+// Runs every benchmark whose name contains filter, for sizes 10^3 up to maxSize
+bool runBenchmarks(size_t maxSize, const string& filter)
+{
+    const char* tmp = getenv("TMPDIR");
+    string dirTemplate = string(tmp && *tmp ? tmp : "/tmp") + "/triage-bench-XXXXXX";
+    vector<char> dirName(dirTemplate.begin(), dirTemplate.end());
+    dirName.push_back('\0');
+    if (!mkdtemp(dirName.data()))
+    {
+        cout<<"ERROR! Cannot create a directory for the benchmark data: " << strerror(errno) <<endl;
+        return false;
+    }
+    string dir = dirName.data();
+    string patientsPath = dir + "/patients.txt";
+    string kbPath = dir + "/diseases.kb";
+    string rulesPath = dir + "/tests.txt";
+    string synonymsPath = dir + "/synonyms.txt";
+    auto wanted = [&](const string& name) { return filter.empty() || name.find(filter) != string::npos; };
+
+    cout<<left << setw(24) << "benchmark" << right << setw(10) << "size" << setw(12) << "iterations" << setw(16) << "ns/op"
+        << setw(14) << "allocs/op" << setw(16) << "items/s" <<endl;
+    bool ok = true;
+    for (size_t n = 1000; n <= maxSize && ok; n *= 10)
+    {
+        mt19937_64 rng(BENCH_SEED + n);
+
+        // patient store
+        vector<Patient> patients = generatePatients(n, rng);
+        if (!writePatients(patients, patientsPath))
+        {
+            cout<<"ERROR! Cannot write " << patientsPath <<endl;
+            ok = false;
+            break;
+        }
+        if (wanted("writePatients"))
+            printBenchmark("writePatients", n, runBenchmark(n, [&] { writePatients(patients, patientsPath); }));
+        if (wanted("readPatients"))
+            printBenchmark("readPatients", n, runBenchmark(n, [&] { benchSink += readPatients(patientsPath).size(); }));
+
+        PatientRepository repository(patients);
+        if (wanted("generatePatientId"))
+            printBenchmark("generatePatientId", n, runBenchmark(1, [&] { benchSink += generatePatientId(repository).size(); }));
+        if (wanted("login"))
+        {
+            // half by patient ID, half by mobile number, a few unknown
+            vector<string> logins(4096);
+            for (size_t i = 0; i < logins.size(); ++i)
+            {
+                const Patient& p = patients[rng() % n];
+                logins[i] = i % 16 == 0 ? "PID0" : (i % 2 ? p.patientId : p.mobileNumber);
+            }
+            size_t next = 0;
+            printBenchmark("login", n, runBenchmark(1, [&] { benchSink += repository.findByLogin(logins[next++ & 4095]) != PatientRepository::NO_PATIENT; }));
+        }
+        if (wanted("stageTimer") && n == 1000)
+            printBenchmark("stageTimer", 1, runBenchmark(1, [&] { StageTimer timer(Stage::Login); }));
+        if (wanted("login") || wanted("memory"))
+        {
+            cout<<"  patient store: " << fixed << setprecision(1) << static_cast<double>(repository.memoryBytes()) / n << " bytes/patient" <<endl;
+        }
+
+        // disease catalogue
+        if (!wanted("identifyDiseases") && !wanted("suggestTests") && !wanted("diagnose"))
+            continue;
+        vector<Disease> diseases = generateCatalogue(n, rng);
+        Catalog catalog;
+        const KnowledgeBase& kb = catalog.kb;
+        const TestRules& rules = catalog.testRules;
+        if (!writeKnowledgeBase(diseases, kbPath) || !catalog.kb.open(kbPath) || !writeBenchTestRules(rulesPath) ||
+            !loadTestRules(kb, rulesPath, catalog.testRules) || !ofstream(synonymsPath) ||
+            !catalog.symptomMatcher.build(kb, synonymsPath))
+        {
+            cout<<"ERROR! Cannot build the benchmark catalogue in " << dir <<endl;
+            ok = false;
+            break;
+        }
+        // queries: two or three symptoms of a random disease
+        vector<SymptomSet> queries(1024, emptySymptomSet(kb));
+        for (SymptomSet& query : queries)
+        {
+            auto symptoms = kb.diseaseSymptoms(static_cast<int>(rng() % kb.diseaseCount()));
+            for (size_t i = 0; i < 2 + rng() % 2; ++i)
+                query.add(symptoms.begin()[rng() % symptoms.size()].symptomId);
+        }
+        size_t next = 0;
+        if (wanted("identifyDiseases"))
+        {
+            printBenchmark("identifyDiseases", n, runBenchmark(1, [&] {
+                ScratchScope scope;
+                benchSink += rankDiseases(kb, queries[next++ & 1023], MAX_SUGGESTIONS).size();
+            }));
+        }
+        if (wanted("suggestTests"))
+        {
+            vector<SymptomSet> matched(queries.size());
+            for (size_t i = 0; i < queries.size(); ++i)
+            {
+                ScratchScope scope;
+                symptomsOfMatches(kb, rankDiseases(kb, queries[i], MAX_SUGGESTIONS), matched[i]);
+            }
+            ostringstream out;
+            printBenchmark("suggestTests", n, runBenchmark(1, [&] {
+                ScratchScope scope;
+                out.seekp(0);
+                suggestTests(out, suggestedTests(rules, matched[next++ & 1023]));
+            }));
+        }
+        if (wanted("diagnose"))
+        {
+            // batch records naming the symptoms of the queries and one unknown; once every record
+            // has been through the result cache, diagnosing must not allocate at all
+            vector<string> records(queries.size());
+            for (size_t i = 0; i < queries.size(); ++i)
+            {
+                records[i] = "PID" + to_string(i + 1) + "\t";
+                for (int id = 0; id < static_cast<int>(kb.symptomCount()); ++id)
+                {
+                    if (queries[i].has(id))
+                        records[i] += string(kb.symptomName(id)) + "; ";
+                }
+                records[i] += "itching";
+            }
+            string out;
+            for (const string& record : records)
+                diagnoseRecord(catalog, record, false, out);
+            BenchResult result = runBenchmark(1, [&] {
+                out.clear();
+                diagnoseRecord(catalog, records[next++ & 1023], false, out);
+                benchSink += out.size();
+            });
+            printBenchmark("diagnose (warm)", n, result);
+            if (result.allocsPerOp != 0)
+            {
+                cout<<"ERROR! A warm diagnosis allocated " << result.allocsPerOp << " times per record, it should not allocate at all." <<endl;
+                ok = false;
+            }
+        }
+    }
+
+    remove(patientsPath.c_str());
+    remove((patientsPath + ".tmp").c_str());
+    remove(kbPath.c_str());
+    remove((kbPath + ".tmp").c_str());
+    remove(rulesPath.c_str());
+    remove(synonymsPath.c_str());
+    rmdir(dir.c_str());
+    return ok;
+}
+
+// Takes "name <value>" out of the arguments and returns the value, empty when the option is not given
+string takeOption(int& argc, char* argv[], const string& name)
+{
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (argv[i] == name)
+        {
+            string value = argv[i + 1];
+            copy(argv + i + 2, argv + argc, argv + i);
+            argc -= 2;
+            return value;
+        }
+    }
+    return string();
+}
+
+int main(int argc, char* argv[])
+{
+    // --journal <file> records the input of the console or server sessions, --metrics <file> keeps a
+    // snapshot of the stage latencies and counters of any mode; both are taken out of the arguments here
+    // so the modes below see their usual ones
+    string journalPath = takeOption(argc, argv, "--journal");
+    MetricsReporter metricsReporter(takeOption(argc, argv, "--metrics"));
+
+    // Converter mode: ./final --build-kb <source.txt> <output.kb>
+    if (argc >= 2 && string(argv[1]) == "--build-kb")
+    {
+        if (argc != 4)
+        {
+            cout<<"Usage: " << argv[0] << " --build-kb <source.txt> <output.kb>" <<endl;
+            return 1;
+        }
+        return buildKnowledgeBase(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    // Migration mode: ./final --migrate-passwords [patient file, default patients.txt] [--threads N]
+    if (argc >= 2 && string(argv[1]) == "--migrate-passwords")
+    {
+        string path = "patients.txt";
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        for (int i = 2; i < argc; ++i)
+        {
+            string arg = argv[i];
+            if (arg == "--threads" && i + 1 < argc)
+                threads = max(1, atoi(argv[++i]));
+            else
+                path = arg;
+        }
+        return migratePasswords(path, threads) ? 0 : 1;
+    }
+
+    // Benchmark mode: ./final --bench [--max N, largest data size, default 100000] [--filter name]
+    if (argc >= 2 && string(argv[1]) == "--bench")
+    {
+        size_t maxSize = 100000;
+        string filter;
+        for (int i = 2; i + 1 < argc; ++i)
+        {
+            string arg = argv[i];
+            if (arg == "--max")
+                maxSize = strtoull(argv[++i], nullptr, 10);
+            else if (arg == "--filter")
+                filter = argv[++i];
+        }
+        return runBenchmarks(maxSize, filter) ? 0 : 1;
+    }
+
+    // Report mode: ./final --feedback-report [feedback file, default feedback.dat]
+    if (argc >= 2 && string(argv[1]) == "--feedback-report")
+    {
+        return printFeedbackReport(argc >= 3 ? argv[2] : "feedback.dat") ? 0 : 1;
+    }
+
+    // End-of-day invoices: ./final --invoices [ledger file, default billing.log] [--date YYYY/MM/DD | --all]
+    if (argc >= 2 && string(argv[1]) == "--invoices")
+    {
+        time_t now = time(0);
+        char today[16];
+        strftime(today, sizeof(today), "%Y/%m/%d", localtime(&now));
+        string ledgerPath = "billing.log";
+        string day = today;
+        for (int i = 2; i < argc; ++i)
+        {
+            string arg = argv[i];
+            if (arg == "--date" && i + 1 < argc)
+                day = argv[++i];
+            else if (arg == "--all")
+                day.clear();
+            else
+                ledgerPath = arg;
+        }
+        return printInvoices(ledgerPath, day) ? 0 : 1;
+    }
+
+    // The disease catalogue is loaded once here, the server also reloads it when its files change
+    CatalogStore catalogs;
+    if (!catalogs.reload())
+    {
+        cout<<"Exiting..." <<endl;
+        return 1;
+    }
+
+    // Batch mode: ./final --batch [input file, default stdin] [--json] [--threads N]
+    if (argc >= 2 && string(argv[1]) == "--batch")
+    {
+        bool json = false;
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        string inputPath;
+        for (int i = 2; i < argc; ++i)
+        {
+            string arg = argv[i];
+            if (arg == "--json")
+                json = true;
+            else if (arg == "--threads" && i + 1 < argc)
+                threads = max(1, atoi(argv[++i]));
+            else if (inputPath.empty() && arg != "-")
+                inputPath = arg;
+        }
+        ios::sync_with_stdio(false);
+        ifstream file;
+        if (!inputPath.empty())
+        {
+            file.open(inputPath, ios::binary);
+            if (!file.is_open())
+            {
+                cerr<<"ERROR! Cannot open " << inputPath <<endl;
+                return 1;
+            }
+        }
+        istream& input = inputPath.empty() ? cin : file;
+        shared_ptr<const Catalog> catalog = catalogs.current();
+        if (threads == 1)
+        {
+            runBatch(*catalog, input, stdout, json);
+        }
+        else
+        {
+            BatchPipeline pipeline(*catalog, json, threads);
+            pipeline.run(input, stdout);
+        }
+        cerr<<"Result cache: " << catalog->resultCache.hits() << " hits, " << catalog->resultCache.misses() << " misses" <<endl;
+        return 0;
+    }
+
+    PatientRepository patients;
+    if (!patients.open("patients.txt", "patients.wal"))
+    {
+        cout<<"ERROR! Could not open the patient store (patients.txt / patients.wal). Exiting..." <<endl;
+        return 1;
+    }
+    // Query mode: ./final --query [--age MIN-MAX] [--gender M|F] [--registered YYYY/MM/DD-YYYY/MM/DD] [--count]
+    // Either end of a range may be left out, e.g. --age 60- for patients of 60 and over
+    if (argc >= 2 && string(argv[1]) == "--query")
+    {
+        PatientQuery q;
+        bool countOnly = false;
+        for (int i = 2; i < argc; ++i)
+        {
+            string arg = argv[i];
+            string value = i + 1 < argc ? argv[i + 1] : "";
+            size_t dash = value.find('-');
+            string from = value.substr(0, dash);
+            string to = dash == string::npos ? from : value.substr(dash + 1);
+            bool valid = true;
+            if (arg == "--count")
+            {
+                countOnly = true;
+                continue;
+            }
+            else if (arg == "--age")
+            {
+                valid = (from.empty() || (isNumeric(from) && from.size() <= 3)) && (to.empty() || (isNumeric(to) && to.size() <= 3)) && !value.empty();
+                if (valid && !from.empty())
+                    q.minAge = stoi(from);
+                if (valid && !to.empty())
+                    q.maxAge = stoi(to);
+            }
+            else if (arg == "--gender")
+            {
+                valid = value.size() == 1;
+                q.gender = static_cast<char>(toupper(value[0]));
+            }
+            else if (arg == "--registered")
+            {
+                valid = !value.empty() && (from.empty() || parseRegistrationDay(from, q.firstRegistrationDay)) && (to.empty() || parseRegistrationDay(to, q.lastRegistrationDay));
+            }
+            else
+            {
+                valid = false;
+            }
+            if (!valid)
+            {
+                cout<<"Usage: " << argv[0] << " --query [--age MIN-MAX] [--gender M|F] [--registered YYYY/MM/DD-YYYY/MM/DD] [--count]" <<endl;
+                return 1;
+            }
+            i++;
+        }
+        auto started = chrono::steady_clock::now();
+        vector<string> ids = patients.query(q);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+        if (!countOnly)
+        {
+            ios::sync_with_stdio(false);
+            for (const string& id : ids)
+                cout<<id << '\n';
+        }
+        cout<<ids.size() << " of " << patients.size() << " patients" <<endl;
+        cerr<<"Query took " << fixed << setprecision(3) << ms << " ms" <<endl;
+        return 0;
+    }
+
+    FeedbackStore feedback;
+    if (!feedback.open("feedback.dat"))
+    {
+        cout<<"ERROR! Could not open the feedback store (feedback.dat). Exiting..." <<endl;
+        return 1;
+    }
+    BillingLedger ledger;
+    if (!ledger.open("billing.log"))
+    {
+        cout<<"ERROR! Could not open the billing ledger (billing.log). Exiting..." <<endl;
+        return 1;
+    }
+    SessionJournal journal;
+    if (!journalPath.empty() && !journal.open(journalPath))
+    {
+        cout<<"ERROR! Could not open the session journal (" << journalPath << "). Exiting..." <<endl;
+        return 1;
+    }
+    TriageServices services{catalogs, patients, feedback, ledger, journalPath.empty() ? nullptr : &journal};
+
+    // Replay mode: ./final --replay <journal>... [--speed N, default 1, 0 for as fast as possible]
+    if (argc >= 2 && string(argv[1]) == "--replay")
+    {
+        double speed = 1;
+        string password;
+        vector<string> paths;
+        for (int i = 2; i < argc; ++i)
+        {
+            string arg = argv[i];
+            if (arg == "--speed" && i + 1 < argc)
+                speed = max(0.0, atof(argv[++i]));
+            else if (arg == "--password" && i + 1 < argc)
+                password = argv[++i];
+            else
+                paths.push_back(arg);
+        }
+        if (paths.empty())
+        {
+            cout<<"Usage: " << argv[0] << " --replay <journal>... [--speed N] [--password <fixture password>]" <<endl;
+            return 1;
+        }
+        ReplayStats stats;
+        if (!replayJournals(services, paths, speed, password, stats))
+            return 1;
+        printReplayStats(stats);
+        patients.sync();
+        feedback.sync();
+        ledger.sync();
+        return 0;
+    }
+
+    // Server mode: ./final --serve <TCP port on 127.0.0.1 | Unix socket path>
+    if (argc >= 2 && string(argv[1]) == "--serve")
+    {
+        if (argc != 3)
+        {
+            cout<<"Usage: " << argv[0] << " --serve <port | socket path>" <<endl;
+            return 1;
+        }
+        catalogs.startWatching();
+        TriageServer server(services);
+        if (!server.run(argv[2]))
+        {
+            cout<<"ERROR! Cannot serve on " << argv[2] << ": " << strerror(errno) <<endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Console mode: one session on the terminal
+    int status = runConsole(services);
+    // Write the updated patient data, feedback and billing back to their files
+    patients.sync();
+    feedback.sync();
+    ledger.sync();
+    return status;
 }